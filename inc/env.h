@@ -36,12 +36,62 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling priorities. Lower values are scheduled first. An env's
+// priority can drift between its base priority (set by
+// sys_env_set_priority) and ENV_PRIO_LOW under the multilevel feedback
+// policy in kern/sched.c.
+#define NENVPRIO			4
+#define ENV_PRIO_HIGH		0
+#define ENV_PRIO_NORMAL		1
+#define ENV_PRIO_LOW		(NENVPRIO - 1)
+
+// Affinity mask allowing every CPU
+#define ENV_AFFINITY_ALL	(~0U)
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
 	ENV_TYPE_FS,			// File system server
 };
 
+// Resource accounting, kept per environment (env_stats) and per CPU.
+struct EnvStats {
+	uint64_t es_cycles;				// TSC cycles spent running envs
+	uint64_t es_idle_cycles;		// TSC cycles spent idle (CPUs only)
+	uint32_t es_syscalls;			// System calls made
+	uint32_t es_pgfaults;			// Page faults reflected to user mode
+	uint32_t es_ipc_sends;			// IPC messages sent
+	uint32_t es_ipc_recvs;			// IPC messages received
+	uint32_t es_pages;				// User pages mapped (envs only;
+									// counted by sys_env_stats)
+};
+
+// One mapping for sys_page_map_batch: the arguments of a sys_page_map.
+struct PageMapOp {
+	envid_t pm_srcenv;
+	void *pm_srcva;
+	envid_t pm_dstenv;
+	void *pm_dstva;
+	int pm_perm;
+};
+
+// Most mappings one sys_page_map_batch call takes
+#define PAGE_MAP_BATCH_MAX	128
+
+// Flag for the perm of sys_ipc_send_region: move the region to the
+// receiver, unmapping it from the sender, instead of sharing it.
+#define IPC_MOVE			0x1000
+
+// A kernel timer, linked into the timer wheel while pending
+// (see kern/timer.c).
+struct Timer {
+	struct Timer *tm_next;			// Next timer in the same wheel slot
+	struct Timer **tm_pprev;		// Link pointing to us; NULL if idle
+	uint32_t tm_expires;			// Timer tick at which to fire
+	void (*tm_func)(void *);		// Called when the timer fires
+	void *tm_arg;					// Argument to tm_func
+};
+
 struct Env {
 	struct Trapframe	env_tf;		// Saved registers
 	struct Env *env_link;			// Next free Env
@@ -50,6 +100,18 @@ struct Env {
 	enum EnvType env_type;			// Indicates special system environments
 	unsigned env_status;			// Status of the environment
 	uint32_t env_runs;				// Number of times environment has run
+	int env_cpunum;					// The CPU the env is running or last ran on
+	struct EnvStats env_stats;		// Resource accounting
+	uint32_t env_affinity;			// Bit i set: env may run on CPU i
+
+	// Scheduling
+	struct Env *env_rq_next;		// Next env on the same run queue
+	struct Env *env_rq_prev;		// Previous env on the same run queue
+	int env_rq_cpu;					// CPU whose run queue holds us, or -1
+	int env_prio;					// Current (feedback-adjusted) priority
+	int env_base_prio;				// Priority to return to on boost
+	int env_slice;					// Ticks used at the current priority
+	struct Timer env_timer;			// Ends sys_sleep_until or an IPC timeout
 
 	// Address space
 	pde_t *env_pgdir;				// Kernel virtual address of page dir
@@ -60,9 +122,19 @@ struct Env {
 	// IPC
 	bool env_ipc_recving;			// Env is blocked receiving
 	void *env_ipc_dstva;			// VA at which to map received page
+	size_t env_ipc_dstlen;			// Bytes of the window at env_ipc_dstva
 	uint32_t env_ipc_value;			// Data value sent to us
 	envid_t env_ipc_from;			// envid of the sender
 	int env_ipc_perm;				// Perm of page mapping received
+	size_t env_ipc_len;				// Bytes of region mapped at env_ipc_dstva
+	envid_t env_ipc_waitfrom;		// Only accept IPC from this env, if set
+	struct IpcMsg *env_ipc_queue;	// Messages sent while we weren't receiving
+	int env_ipc_nqueued;			// Length of env_ipc_queue
+	struct IpcMsg *env_ipc_blocked;	// Messages of senders waiting for room
+	struct IpcMsg *env_ipc_pending;	// Our message, while we wait on it
+	struct Env *env_ipc_callers;	// Envs whose env_ipc_waitfrom is us
+	struct Env *env_ipc_caller_next;	// Next env waiting on the same env
+	struct Env *env_ipc_caller_prev;	// Previous env waiting on the same env
 };
 
 #endif 	/* !YUOS_INC_ENV_H */
@@ -14,6 +14,7 @@ enum {
 	E_NO_SYS	,		// Unimplemented system call
 
 	E_IPC_NOT_RECV ,		// Attempt to send to env that is not recving
+	E_TIMEOUT ,				// Timed out waiting for an event
 	E_EOF ,					// Unexpected end of file
 
 	// File system error codes -- only seen in user-level
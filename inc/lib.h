@@ -57,10 +57,25 @@ int sys_page_unmap(envid_t env, void *pg);
 void sys_yield(void);
 int sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
-int sys_ipc_recv(void *rcv_pg);
+int sys_ipc_recv(void *rcv_pg, unsigned int timeout);
 unsigned int sys_time_msec(void);
 int sys_tx_pkt(struct tx_desc*);
 int sys_rx_pkt(struct rx_desc*);
+int sys_env_set_priority(envid_t env, int prio);
+uint64_t sys_time_nsec(void);
+int sys_sleep_until(unsigned int msec);
+int sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int sys_env_set_affinity(envid_t env, uint32_t mask);
+int sys_env_stats(envid_t env, struct EnvStats *st);
+int sys_cpu_stats(int cpu, struct EnvStats *st);
+int sys_page_alloc_large(envid_t env, void *pg, int perm);
+int sys_page_map_batch(const struct PageMapOp *ops, unsigned n, int *results);
+envid_t sys_fork(void);
+int sys_page_zero(envid_t env, void *pg, size_t len, int perm);
+int sys_ipc_send_region(envid_t to_env, uint32_t value, void *pg, size_t len,
+			int perm);
+int sys_ipc_recv_region(void *rcv_pg, size_t len, unsigned int timeout);
+int sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 
 // This must be inlined.
 static __inline envid_t __attribute__((always_inline))
@@ -78,10 +93,17 @@ sys_exofork(void)
 // ipc.c
 void ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 unsigned int timeout);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+void ipc_send_region(envid_t to_env, uint32_t value, void *pg, size_t len,
+		     int perm);
+int32_t ipc_recv_region(envid_t *from_env_store, void *pg, size_t len,
+			size_t *len_store, int *perm_store);
 envid_t ipc_find_env(enum EnvType type);
 
 // fork.c
-#define PTE_SHARE	0x400
 envid_t fork(void);
 
 // fd.c
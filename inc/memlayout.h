@@ -109,7 +109,7 @@ typedef uint32_t	pde_t;
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
+	// Next block on the free list.
 	struct PageInfo *pp_link;
 
 	// pp_ref is the count of pointers (usually in page table entries)
@@ -118,6 +118,13 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state, meaningful only in the first page of a
+	// free block (see kern/pmap.c).
+	uint8_t pp_order;		// log2 of the block's size in pages
+	bool pp_free;			// First page of a free block
+	bool pp_cached;			// In a page magazine or the zeroed pool
+	struct PageInfo *pp_prev;	// Previous block on the same free list
 };
 #endif /* !__ASSEMBLER__ */
 
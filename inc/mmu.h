@@ -66,12 +66,28 @@
 // the hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL 	0xE00	// Available for software use
 
+// PTE_COW marks copy-on-write page table entries. It is one of the
+// PTE_AVAIL bits; the kernel gives a page with it set a private, writable
+// copy when the environment writes to it (page_cow_break).
+#define PTE_COW		0x800
+
+// PTE_SHARE marks pages that fork and spawn share with the child as they
+// are, rather than copying them. Also one of the PTE_AVAIL bits. In the
+// PDE of a page table, the kernel sets it once the table maps a PTE_SHARE
+// page (see page_insert).
+#define PTE_SHARE	0x400
+
 // Flags in PTE_SYSCALL may be used in system calls. (Others may not.)
 #define PTE_SYSCALL (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte) ((physaddr_t) (pte) & ~0xFFF)
 
+// Page fault error codes
+#define FEC_PR		0x1	// Page fault caused by protection violation
+#define FEC_WR		0x2	// Page fault caused by a write
+#define FEC_U		0x4	// Page fault occured while in user mode
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -85,6 +101,9 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_PSE		0x00000010	// Page Size Extensions (4MB pages)
+#define CR4_PGE		0x00000080	// Page Global Enable
+
 // Eflags register
 #define FL_IF		0x00000200  // Interrupt Flag
 #define FL_IOPL_MASK	0x00003000	// I/O Privilege Level bitmask
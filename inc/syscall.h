@@ -20,6 +20,20 @@ enum {
 	SYS_time_msec,
 	SYS_tx_pkt,
 	SYS_rx_pkt,
+	SYS_env_set_priority,
+	SYS_time_nsec,
+	SYS_sleep_until,
+	SYS_ipc_call,
+	SYS_env_set_affinity,
+	SYS_env_stats,
+	SYS_cpu_stats,
+	SYS_page_alloc_large,
+	SYS_page_map_batch,
+	SYS_fork,
+	SYS_page_zero,
+	SYS_ipc_send_region,
+	SYS_ipc_recv_region,
+	SYS_ipc_send,
 	NSYSCALLS
 };
 
@@ -38,6 +38,8 @@
 #define IRQ_SPURIOUS 	7
 #define IRQ_IDE 		14
 #define IRQ_ERROR		19
+#define IRQ_RESCHED		20		// IPI: work was queued for an idle CPU
+#define IRQ_TLB			21		// IPI: flush TLB entries (tlb_shootdown)
 
 #ifndef __ASSEMBLER__
 
@@ -293,4 +293,16 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	uint32_t result = inc;
+
+	// Atomically add inc to *addr and return the old value of *addr.
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (result), "+m" (*addr) :
+			: "cc", "memory");
+	return result;
+}
+
 #endif /* !YUOS_INC_X86_H */
\ No newline at end of file
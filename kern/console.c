@@ -5,9 +5,12 @@
 #include <inc/stdio.h>
 
 #include <kern/console.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
-static void cons_putc(int c);
+
+// Serializes console output and the console input buffer
+static struct spinlock console_lock;
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -339,8 +342,14 @@ kbd_proc_data(void)
 
 	// Process special keys
 	// Ctrl-Alt-Del: reboot
+	// We are called with console_lock held, so write the message
+	// with cons_putc: cprintf would take the lock again.
 	if (!(~shift & (CTL | ALT)) && c == KEY_DEL) {
-		cprintf("Rebooting!\n");
+		const char *msg = "Rebooting!\n";
+
+		while (*msg) {
+			cons_putc(*msg++);
+		}
 		outb(0x92, 0x3); // courtesy of Chris Frost
 	}
 
@@ -393,7 +402,8 @@ cons_intr(int (*proc)(void))
 int
 cons_getc(void)
 {
-	int c;
+	int c = 0;
+	bool locked = lock_console();
 
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
@@ -407,13 +417,13 @@ cons_getc(void)
 		if (cons.rpos == CONSBUFSIZE) {
 			cons.rpos = 0;
 		}
-		return c;
 	}
-	return 0;
+	unlock_console(locked);
+	return c;
 }
 
-// output a character to the console
-static void
+// output a character to the console; the caller holds console_lock
+void
 cons_putc(int c)
 {
 	serial_putc(c);
@@ -425,6 +435,7 @@ cons_putc(int c)
 void
 cons_init(void)
 {
+	spin_initlock(&console_lock);
 	cga_init();
 	kbd_init();
 	serial_init();
@@ -433,10 +444,36 @@ cons_init(void)
 
 // `High`-level console I/O. Used by readline and cprintf.
 
+// Take console_lock, unless a panic is in progress: the panicking CPU
+// may already hold it, and must still be able to print. Returns whether
+// the lock was taken, to pass to unlock_console.
+bool
+lock_console(void)
+{
+	extern const char *panicstr;
+
+	if (panicstr) {
+		return 0;
+	}
+	spin_lock(&console_lock);
+	return 1;
+}
+
+void
+unlock_console(bool locked)
+{
+	if (locked) {
+		spin_unlock(&console_lock);
+	}
+}
+
 void
 cputchar(int c)
 {
+	bool locked = lock_console();
+
 	cons_putc(c);
+	unlock_console(locked);
 }
 
 int
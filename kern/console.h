@@ -14,6 +14,9 @@
 
 void cons_init(void);
 int cons_getc(void);
+void cons_putc(int c);
+bool lock_console(void);
+void unlock_console(bool locked);
 
 void kbd_intr(void);	// irq 1
 void serial_intr(void);	//  irq 4
@@ -16,12 +16,42 @@ enum {
 	CPU_HALTED,
 };
 
+// Per-CPU queues of ENV_RUNNABLE environments, one per priority
+// level (see kern/sched.c)
+struct RunQueue {
+	struct Env *rq_head[NENVPRIO];  // Next env to run at each priority
+	struct Env *rq_tail[NENVPRIO];  // Most recently queued env at each priority
+	int rq_len;                     // Number of envs on all the queues
+	uint32_t rq_ticks;              // Timer ticks seen by this CPU
+};
+
+// TLB flushes that other CPUs have asked this CPU to carry out (see
+// tlb_shootdown in kern/pmap.c). Requests are numbered; ts_va holds the
+// pages of request ts_va_req only, and a CPU that finds it has missed
+// one flushes everything instead.
+#define TLB_BATCH_MAX	32
+
+struct TlbShootdown {
+	volatile uint32_t ts_req;       // Latest request posted
+	volatile uint32_t ts_done;      // Latest request carried out
+	uint32_t ts_va_req;             // Request that ts_va belongs to
+	int ts_nva;                     // Pages in ts_va; > TLB_BATCH_MAX: all
+	uintptr_t ts_va[TLB_BATCH_MAX];
+};
+
 // Per-CPU state
 struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct RunQueue cpu_runq;       // Runnable envs waiting for this CPU
+	volatile bool cpu_kicked;       // A wakeup IPI is on its way to this CPU
+	struct EnvStats cpu_stats;      // Resource accounting for this CPU
+	uint64_t cpu_acct_tsc;          // TSC when cpu_stats was last charged
+	pde_t *cpu_pgdir;               // Page directory loaded in %cr3
+	volatile uint32_t cpu_user;     // Running user code, with interrupts on
+	struct TlbShootdown cpu_tlb;    // TLB flushes posted by other CPUs
 };
 
 // Initialized in mpconfig.c
@@ -41,5 +71,10 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_timer_periodic(void);
+void lapic_timer_oneshot(uint32_t count);
+uint32_t lapic_timer_count(void);
+extern uint32_t lapic_timer_ticr;   // LAPIC timer counts per tick
 
 #endif
@@ -8,13 +8,21 @@
 #include <kern/pmap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/timer.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/syscall.h>
 
 struct Env *envs = NULL;		// All environments
-struct Env *curenv	= NULL;		// The current env
 static struct Env *env_free_list;	// Free environment list
+int env_nlive;				// Number of allocated environments
+// Protects env_free_list and env_nlive
+static struct spinlock env_lock;
 
 #define ENVGENSHIFT 12 		// >= LOGNENV
 
+static int env_reclaim_all(void);
+
 // Global descriptor table.
 //
 // Set up global descriptor table (GDT) with separate segments for
@@ -30,7 +38,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[] =
+struct Segdesc gdt[NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -47,7 +55,8 @@ struct Segdesc gdt[] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
-	// 0x28 - tss, initialized in trap_init_percpu()
+	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
+	// in trap_init_percpu()
 	[GD_TSS0 >> 3] = SEG_NULL
 };
 
@@ -112,12 +121,18 @@ env_init(void)
 {
 	// Set up envs array
 	int i;
+
+	spin_initlock(&env_lock);
 	for (i = NENV - 1; i >= 0; i--) {
 		envs[i].env_link = env_free_list;
 		env_free_list = &envs[i];
 		envs[i].env_id = 0;
 	}
 
+	// Let the page allocator finish tearing down dead envs' address
+	// spaces when it runs out of memory.
+	page_set_reclaim(env_reclaim_all);
+
 	// Per-CPU part of the initialization
 	env_init_percpu();
 }
@@ -156,11 +171,11 @@ env_init_percpu(void)
 static int
 env_setup_vm(struct Env *e)
 {
-	int i;
 	struct PageInfo *p = NULL;
 
-	// Allocate a page for the page directory
-	if (!(p = page_alloc(ALLOC_ZERO))) {
+	// Allocate a page for the page directory. pgdir_alloc recycles the
+	// page directories of dead envs, and fills in the kernel portion.
+	if (!(p = pgdir_alloc())) {
 		return -E_NO_MEM;
 	}
 
@@ -180,9 +195,6 @@ env_setup_vm(struct Env *e)
 	//	pp_ref for env_free to work correctly.
 	//		- The functions in kern/pmap.h are handy.
 	e->env_pgdir = (pde_t*) page2kva(p);
-	for (i = UTOP/PTSIZE; i < NPDENTRIES; i++) {
-		e->env_pgdir[i] = kern_pgdir[i];
-	}
 	p->pp_ref++;
 
 	// UVPT maps the env's own page table read-only.
@@ -207,12 +219,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
+	spin_lock(&env_lock);
 	if (!(e = env_free_list)) {
+		spin_unlock(&env_lock);
 		return -E_NO_FREE_ENV;
 	}
 
 	// Allocate and set up the page directory for this environment.
 	if ((r = env_setup_vm(e)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
 	}
 
@@ -225,8 +240,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_cpunum = -1;
+	e->env_affinity = ENV_AFFINITY_ALL;
+	memset(&e->env_stats, 0, sizeof(e->env_stats));
+	e->env_rq_cpu = -1;
+	e->env_prio = e->env_base_prio = ENV_PRIO_NORMAL;
+	e->env_slice = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -255,8 +275,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
+	// No sleep or IPC timeout pending.
+	e->env_timer.tm_pprev = NULL;
+
 	// commit the allocation
 	env_free_list = e->env_link;
+	env_nlive++;
+	spin_unlock(&env_lock);
+	env_set_status(e, ENV_RUNNABLE);
 	*newenv_store = e;
 
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -284,6 +310,11 @@ region_alloc(struct Env *e, void *va, size_t len)
 	end = (void *) ROUNDUP(va + len, PGSIZE);
 
 	for (addr = start; addr < end; addr += PGSIZE) {
+		// A page shared with the previous segment keeps its contents.
+		page = page_lookup(e->env_pgdir, addr, NULL);
+		if (page != NULL && page != zero_page) {
+			continue;
+		}
 		page = page_alloc(ALLOC_ZERO);
 		if (page == NULL) {
 			panic("region_alloc: alloc page failed");
@@ -353,9 +384,10 @@ load_icode(struct Env *e, uint8_t *binary)
 	struct Proghdr *ph, *eph;
 
 	struct PageInfo *page;
+	uintptr_t va, filend, memend;
 
 	// Make e's page directory be in force for memmory copy
-	lcr3(PADDR(e->env_pgdir));
+	pgdir_load(e->env_pgdir);
 
 	elfhdr = (struct Elf*) binary;
 	if (elfhdr->e_magic != ELF_MAGIC) {
@@ -369,13 +401,26 @@ load_icode(struct Env *e, uint8_t *binary)
 		if (ph->p_type != ELF_PROG_LOAD) {
 			continue;
 		}
-		region_alloc(e, (void *)(ph->p_va), (size_t)(ph->p_memsz));
-		memset((void *)(ph->p_va), 0, (size_t)(ph->p_memsz));
+		// Only the pages with file data in them get memory now. The
+		// rest of the bss maps the zero page until it is written.
+		filend = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+		memend = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
+		region_alloc(e, (void *)(ph->p_va), MIN(filend, memend) - ph->p_va);
+		for (va = filend; va < memend; va += PGSIZE) {
+			if (page_lookup(e->env_pgdir, (void *) va, NULL)) {
+				continue;
+			}
+			if (page_map_zero(e->env_pgdir, (void *) va, PTE_U | PTE_W | PTE_P) < 0) {
+				panic("load_icode: out of memory for the bss");
+			}
+		}
+		memset((void *)(ph->p_va + ph->p_filesz), 0,
+			MIN(filend, ph->p_va + ph->p_memsz) - (ph->p_va + ph->p_filesz));
 		memmove((void *)(ph->p_va), (void *)(binary + ph->p_offset), (size_t)(ph->p_filesz));
 	}
 
 	// Restore the cr3 register
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
 
 	// Set the program's entry point
 	e->env_tf.tf_eip = elfhdr->e_entry;
@@ -411,64 +456,238 @@ env_create(uint8_t *binary, enum EnvType type)
 
 	if (type == ENV_TYPE_FS) {
 		e->env_tf.tf_eflags |= FL_IOPL_MASK;
+		// Everything else waits on the file system server.
+		sched_set_priority(e, ENV_PRIO_HIGH);
 	}
 
 	return;
 }
 
+// Address spaces of freed envs.
+//
+// env_free only drops a dead env's shared pages (reclaim_shared) and
+// queues its page directory here, linked through the pp_link of its
+// PageInfo. env_reclaim tears the queue down a bounded number of page
+// tables at a time: a few on every timer tick, batches on idle CPUs
+// (env_reclaim_idle), and all of it when the page allocator runs out of
+// memory (env_reclaim_all).
+// The pages go back to the allocator in bulk, with page_free_bulk;
+// cleared page tables go to the zeroed page pool, and page directories
+// to pgdir_alloc's cache. The queue is protected by the big kernel lock,
+// as are the reference counts of the pages in it.
+//
+// No CPU has these page directories loaded, so there is no TLB to flush.
+static struct PageInfo *reclaim_head;
+static struct PageInfo **reclaim_tail = &reclaim_head;
+static uint32_t reclaim_pdeno;	// Next PDE of reclaim_head to tear down
+
+#define RECLAIM_BULK	64		// Pages freed with one page_free_bulk
+
+struct ReclaimBulk {
+	struct PageInfo *rb_pages[RECLAIM_BULK];
+	int rb_n;
+};
+
+// Drop a reference to pp, adding it to rb if that was the last.
+static void
+reclaim_decref(struct ReclaimBulk *rb, struct PageInfo *pp)
+{
+	if (--pp->pp_ref > 0) {
+		return;
+	}
+	if (rb->rb_n == RECLAIM_BULK) {
+		page_free_bulk(rb->rb_pages, rb->rb_n);
+		rb->rb_n = 0;
+	}
+	rb->rb_pages[rb->rb_n++] = pp;
+}
+
 //
-// Frees env e and all memory it uses.
+// Tear down up to 'budget' page tables (or 4MB pages, or finished page
+// directories) of the address spaces that env_free left behind.
+// Returns how many it tore down, so 0 once there is nothing left.
+// The caller holds the big kernel lock.
 //
-void
-env_free(struct Env *e)
+int
+env_reclaim(int budget)
 {
+	struct ReclaimBulk rb;
+	struct PageInfo *pp;
+	pde_t *pgdir;
 	pte_t *pt;
-	uint32_t pdeno, pteno;
-	physaddr_t pa;
+	uint32_t pteno;
+	int done = 0;
+
+	rb.rb_n = 0;
+	while ((pp = reclaim_head) != NULL && done < budget) {
+		pgdir = page2kva(pp);
+		for (; reclaim_pdeno < PDX(UTOP) && done < budget; reclaim_pdeno++) {
+			if (!(pgdir[reclaim_pdeno] & PTE_P)) {
+				continue;
+			}
+			done++;
+
+			// a 4MB page has no page table
+			if (pgdir[reclaim_pdeno] & PTE_PS) {
+				pp = pa2page(PTE_ADDR(pgdir[reclaim_pdeno]));
+				pgdir[reclaim_pdeno] = 0;
+				if (--pp->pp_ref == 0) {
+					page_free_order(pp, PAGE_PSE_ORDER);
+				}
+				continue;
+			}
 
-	// If freeing the current environment, switch to kern_pgdir
-	// before freeing the page directory, just in case the page
-	// gets reused.
-	if (e == curenv) {
-		lcr3(PADDR(kern_pgdir));
+			// Clear the page table as we go, so that it can be
+			// reused as a zeroed page.
+			pt = (pte_t *) KADDR(PTE_ADDR(pgdir[reclaim_pdeno]));
+			for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+				if (pt[pteno] & PTE_P) {
+					reclaim_decref(&rb, pa2page(PTE_ADDR(pt[pteno])));
+					pt[pteno] = 0;
+				}
+			}
+			pp = pa2page(PTE_ADDR(pgdir[reclaim_pdeno]));
+			pgdir[reclaim_pdeno] = 0;
+			if (--pp->pp_ref == 0) {
+				page_free_zeroed(pp);
+			}
+		}
+		if (reclaim_pdeno < PDX(UTOP)) {
+			break;
+		}
+
+		// Done with this one; its page directory is as good as new.
+		pp = reclaim_head;
+		if (!(reclaim_head = pp->pp_link)) {
+			reclaim_tail = &reclaim_head;
+		}
+		pp->pp_link = NULL;
+		reclaim_pdeno = 0;
+		if (--pp->pp_ref == 0) {
+			pgdir_free(pp);
+		}
+		done++;
 	}
 
-	// Note the environment's demise.
-	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+	if (rb.rb_n > 0) {
+		page_free_bulk(rb.rb_pages, rb.rb_n);
+	}
+	return done;
+}
+
+//
+// Drop the PTE_SHARE mappings of a dead env's address space at once,
+// rather than leave them to env_reclaim: servers tell whether a client
+// still has a file open by the reference count of a shared page (see
+// pageref in fs/serv.c), and a dead client must not hold one.
+// Only the page tables that page_insert marked as holding shared pages
+// are scanned, so the cost depends on how much of the address space
+// was shared, not on its size.
+//
+static void
+reclaim_shared(pde_t *pgdir)
+{
+	struct ReclaimBulk rb;
+	struct PageInfo *pp;
+	pte_t *pt;
+	uint32_t pdeno, pteno;
 
-	// Flush all mapped pages in the user portion of the address space
-	// static_assert(UTOP % PTSIZE == 0);
+	rb.rb_n = 0;
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P)) {
+		if (!(pgdir[pdeno] & PTE_P)) {
+			continue;
+		}
+		if (pgdir[pdeno] & PTE_PS) {
+			if (pgdir[pdeno] & PTE_SHARE) {
+				pp = pa2page(PTE_ADDR(pgdir[pdeno]));
+				pgdir[pdeno] = 0;
+				if (--pp->pp_ref == 0) {
+					page_free_order(pp, PAGE_PSE_ORDER);
+				}
+			}
+			continue;
+		}
+		if (!(pgdir[pdeno] & PTE_SHARE)) {
 			continue;
 		}
 
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P) {
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+		pt = (pte_t *) KADDR(PTE_ADDR(pgdir[pdeno]));
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			if ((pt[pteno] & (PTE_P | PTE_SHARE)) == (PTE_P | PTE_SHARE)) {
+				reclaim_decref(&rb, pa2page(PTE_ADDR(pt[pteno])));
+				pt[pteno] = 0;
 			}
 		}
+	}
+
+	if (rb.rb_n > 0) {
+		page_free_bulk(rb.rb_pages, rb.rb_n);
+	}
+}
+
+//
+// Reclaim dead address spaces until there are none left or this CPU is
+// given work. Called by sched_halt on an idle CPU without the big kernel
+// lock, which is taken for one batch at a time.
+//
+void
+env_reclaim_idle(void)
+{
+	int done = 1;
 
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+	while (done > 0 && reclaim_head != NULL && !thiscpu->cpu_kicked) {
+		lock_kernel();
+		done = env_reclaim(ENV_RECLAIM_IDLE);
+		unlock_kernel();
 	}
+}
 
-	// free the page directory
-	pa = PADDR(e->env_pgdir);
+// The page allocator's reclaim hook (see page_set_reclaim): tear down
+// every queued address space. Returns whether that freed anything.
+static int
+env_reclaim_all(void)
+{
+	return env_reclaim(ENV_RECLAIM_ALL) > 0;
+}
+
+//
+// Frees env e and all memory it uses.
+//
+void
+env_free(struct Env *e)
+{
+	struct PageInfo *pp;
+
+	// If freeing the current environment, switch to kern_pgdir
+	// before freeing the page directory, just in case the page
+	// gets reused.
+	if (e == curenv) {
+		pgdir_load(kern_pgdir);
+	}
+
+	// Note the environment's demise.
+	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+
+	// Drop the messages queued for e, and let their senders go.
+	ipc_env_free(e);
+
+	// Leave the user portion of the address space to env_reclaim, so
+	// that freeing a big env costs no more than freeing a small one,
+	// except for the shared pages, whose references others count.
+	// Nothing can be running on it any more: e is not curenv anywhere.
+	reclaim_shared(e->env_pgdir);
+	pp = pa2page(PADDR(e->env_pgdir));
 	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
+	*reclaim_tail = pp;
+	reclaim_tail = &pp->pp_link;
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	env_set_status(e, ENV_FREE);
+	spin_lock(&env_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	env_nlive--;
+	spin_unlock(&env_lock);
 }
 
 //
@@ -477,6 +696,14 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
+	// If e is currently running on other CPUs, we change its state to
+	// ENV_DYING. A zombie environment will be freed the next time
+	// it traps to the kernel.
+	if (e->env_status == ENV_RUNNING && curenv != e) {
+		env_set_status(e, ENV_DYING);
+		return;
+	}
+
 	env_free(e);
 
 	if (curenv == e) {
@@ -485,6 +712,56 @@ env_destroy(struct Env *e)
 	}
 }
 
+//
+// Return the number of user pages mapped in e's address space.
+// Walks e's page tables, so this costs O(mapped page tables).
+//
+int
+env_npages(struct Env *e)
+{
+	pte_t *pt;
+	int n = 0, i, j;
+
+	for (i = 0; i < PDX(UTOP); i++) {
+		if (!(e->env_pgdir[i] & PTE_P)) {
+			continue;
+		}
+		if (e->env_pgdir[i] & PTE_PS) {
+			n += NPTENTRIES;
+			continue;
+		}
+		pt = (pte_t *) KADDR(PTE_ADDR(e->env_pgdir[i]));
+		for (j = 0; j < NPTENTRIES; j++) {
+			if (pt[j] & PTE_P) {
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+//
+// Change e's status to 'status', moving it onto or off a run queue
+// as needed: an env is queued exactly while it is ENV_RUNNABLE.
+// All writes to env_status must go through here.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	if (e->env_status == ENV_RUNNABLE) {
+		sched_dequeue(e);
+	}
+	// A pending env_timer belongs to the wait that blocked e; whatever
+	// ends the wait disarms it.
+	if (status != ENV_NOT_RUNNABLE) {
+		timer_cancel(&e->env_timer);
+	}
+	e->env_status = status;
+	if (status == ENV_RUNNABLE) {
+		sched_enqueue(e);
+	}
+}
+
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
 // This exits the kernel and starts executing some environment's code.
@@ -494,6 +771,11 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf)
 {
+	// Interrupts come back on with the iret, so tlb_shootdown can
+	// reach us by IPI from here on; catch any flush posted before that.
+	xchg(&thiscpu->cpu_user, 1);
+	tlb_shootdown_poll();
+
 	__asm __volatile("movl %0,%%esp\n"
 		"\tpopal\n"
 		"\tpopl %%es\n"
@@ -524,14 +806,23 @@ env_run(struct Env *e)
 	// Step 2: Use env_pop_tf() to restore the environment's
 	//		registers and drop into user mode in the
 	//		environment.
-	if (curenv != NULL && curenv->env_status == ENV_RUNNING) {
-		curenv->env_status = ENV_RUNNABLE;
+	sched_account();
+	if (curenv != NULL && curenv != e && curenv->env_status == ENV_RUNNING) {
+		env_set_status(curenv, ENV_RUNNABLE);
 	}
 	curenv = e;
-	curenv->env_status = ENV_RUNNING;
+	env_set_status(curenv, ENV_RUNNING);
 	curenv->env_runs++;
+	curenv->env_cpunum = cpunum();
+
+	// Only switch address spaces if we have to: reloading %cr3 flushes
+	// the TLB of all the env's entries. (The kernel's are global.)
+	if (thiscpu->cpu_pgdir != curenv->env_pgdir) {
+		pgdir_load(curenv->env_pgdir);
+	}
 
-	lcr3(PADDR(curenv->env_pgdir));
+	// Release the big kernel lock as we leave the kernel.
+	unlock_kernel();
 
 	// Hint: This function loads the new environment's state from
 	//	e->env_tf.	Go back through the code we worte above
@@ -2,9 +2,11 @@
 #define	YUOS_KERN_ENV_H
 
 #include <inc/env.h>
+#include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;		// Current environment
+extern int env_nlive;			// Number of allocated environments
+#define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
 void 	env_init(void);
@@ -13,6 +15,16 @@ void 	env_create(uint8_t *binary, enum EnvType type);
 int 	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_set_status(struct Env *e, unsigned status);
+int	env_npages(struct Env *e);
+int	env_reclaim(int budget);
+void	env_reclaim_idle(void);
+
+// Page tables that env_reclaim tears down per timer tick, per batch on
+// an idle CPU, and when memory runs out
+#define ENV_RECLAIM_TICK	4
+#define ENV_RECLAIM_IDLE	32
+#define ENV_RECLAIM_ALL		0x7fffffff
 
 int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
@@ -30,4 +42,11 @@ void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 			type);		\
 	} while(0)
 
+// Count one event in the 'field' accounting counter of both e and this CPU.
+#define ENV_STAT_INC(e, field)			\
+	do {						\
+		(e)->env_stats.field++;		\
+		thiscpu->cpu_stats.field++;	\
+	} while(0)
+
 #endif 	/* !YUOS_KERN_ENV_H */
\ No newline at end of file
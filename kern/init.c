@@ -4,12 +4,17 @@
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/spinlock.h>
+#include <kern/sched.h>
+
+static void boot_aps(void);
 
 void
 i386_init(void)
@@ -28,6 +33,7 @@ i386_init(void)
 	cprintf("Hello, I'm Yu-OS\n");
 
 	mem_init();
+	kmem_init();
 
 	env_init();
 	trap_init();
@@ -39,10 +45,16 @@ i386_init(void)
 	// multitasking initialization functions
 	pic_init();
 
+	// Acquire the big kernel lock before waking up APs
+	lock_kernel();
+
 	// hardware initialization functions
 	time_init();
 	pci_init();
 
+	// Starting non-boot CPUs
+	boot_aps();
+
 //	ENV_CREATE(user_hello, ENV_TYPE_USER);
 //	ENV_CREATE(user_divzero, ENV_TYPE_USER);
 //	ENV_CREATE(user_dumbfork, ENV_TYPE_USER);
@@ -62,13 +74,14 @@ i386_init(void)
 //	ENV_CREATE(user_testkbd, ENV_TYPE_USER);
 //	ENV_CREATE(user_icode, ENV_TYPE_USER);
 //	ENV_CREATE(user_testtime, ENV_TYPE_USER);
-
-	env_run(&envs[0]);
-
-	// Drop into the kernel monitor.
-	while (1) {
-		monitor(NULL);
-	}
+//	ENV_CREATE(user_testipctimeout, ENV_TYPE_USER);
+//	ENV_CREATE(user_testcow, ENV_TYPE_USER);
+//	ENV_CREATE(user_testbss, ENV_TYPE_USER);
+//	ENV_CREATE(user_testregion, ENV_TYPE_USER);
+//	ENV_CREATE(user_testipcqueue, ENV_TYPE_USER);
+
+	// Schedule and run the first user environment!
+	sched_yield();
 }
 
 // While boot_aps is booting a given CPU, it communicates the per-core
@@ -108,7 +121,8 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
+	pgdir_load(kern_pgdir);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -119,11 +133,8 @@ mp_main(void)
 	// Now that we have finished some basic setup, call sched_yield()
 	// to start running processes on this CPU.  But make sure that
 	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-
-	// Remove this after you finish Exercise 4
-	for (;;);
+	lock_kernel();
+	sched_yield();
 }
 
 /*
@@ -21,6 +21,17 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)	/* RTC offset 0x32 */
 
+/* 8253/8254 programmable interval timer, used to calibrate the LAPIC and TSC */
+#define	IO_TIMER1	0x040		/* 8253 Timer #1 */
+#define	TIMER_CNTR2	(IO_TIMER1 + 2)	/* timer counter 2 (PC speaker) */
+#define	TIMER_MODE	(IO_TIMER1 + 3)	/* timer mode port */
+#define	TIMER_SEL2	0xb0		/* select counter 2, LSB then MSB, mode 0 */
+#define	TIMER_FREQ	1193182		/* input clock, in Hz */
+#define	IO_PPI		0x061		/* keyboard controller port B */
+#define	PPI_GATE2	0x01		/* counter 2 gate */
+#define	PPI_SPKR	0x02		/* speaker enable */
+#define	PPI_OUT2	0x20		/* counter 2 output */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 
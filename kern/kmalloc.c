@@ -0,0 +1,350 @@
+// Kernel memory allocator.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/mmu.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Slab allocator.
+//
+// Requests of up to KMEM_MAX_SIZE bytes are rounded up to a power-of-two
+// size class and carved out of slabs: single pages that start with a
+// struct KmemSlab header and hold objects of one class, linked through
+// their first word while free. Larger requests get a block of whole pages
+// from page_alloc_order with the same header in front. Either way, kfree
+// finds the header by rounding the pointer down to its page.
+//
+// In front of the slabs, each CPU keeps a magazine of free objects per
+// size class, as page_alloc does for pages, so that most kmalloc and
+// kfree calls take no lock. The kernel runs with interrupts disabled, so
+// a magazine is only ever touched by its own CPU.
+//
+// kmem_lock protects the slabs and the shared counters. It is never held
+// while calling into the page allocator.
+
+#define KMEM_MIN_SHIFT	4				// Smallest class: 16 bytes
+#define KMEM_MAX_SHIFT	10				// Largest class: 1024 bytes
+#define KMEM_MAX_SIZE	(1 << KMEM_MAX_SHIFT)
+#define KMEM_NCLASSES	(KMEM_MAX_SHIFT - KMEM_MIN_SHIFT + 1)
+#define KMEM_MAG_SIZE	16
+#define KMEM_MAG_BATCH	(KMEM_MAG_SIZE / 2)
+
+struct KmemSlab {
+	struct KmemCache *ks_cache;		// Size class, or NULL for a large block
+	struct KmemSlab *ks_next;		// Next slab of the class with free objects
+	struct KmemSlab **ks_pprev;		// Link pointing at us, if on that list
+	void *ks_free;					// Free objects, linked through first word
+	uint16_t ks_inuse;				// Objects out of the slab
+	uint16_t ks_order;				// Large block: its page_alloc_order order
+};
+
+// Objects start this far into a slab or large block, which keeps them
+// 16-byte aligned.
+#define KMEM_HDR		ROUNDUP(sizeof(struct KmemSlab), 1 << KMEM_MIN_SHIFT)
+
+struct KmemMagazine {
+	void *km_objs[KMEM_MAG_SIZE];
+	int km_count;
+	uint32_t km_hits;			// kmalloc served from the magazine
+	uint32_t km_misses;			// kmalloc that had to refill it
+	uint32_t km_frees;			// kfree calls
+};
+
+static struct KmemCache {
+	size_t kc_size;					// Object size
+	struct KmemSlab *kc_partial;	// Slabs with free objects
+	uint32_t kc_nslabs;				// Slabs held
+	uint32_t kc_out;				// Objects out of the slabs
+	struct KmemMagazine kc_mags[NCPU];
+} kmem_caches[KMEM_NCLASSES];
+
+static struct spinlock kmem_lock;
+static uint32_t kmem_large_pages;	// Pages held by large blocks
+static uint32_t kmem_large_allocs;	// Large blocks handed out
+
+void
+kmem_init(void)
+{
+	int i;
+
+	spin_initlock(&kmem_lock);
+	for (i = 0; i < KMEM_NCLASSES; i++) {
+		kmem_caches[i].kc_size = 1 << (KMEM_MIN_SHIFT + i);
+	}
+}
+
+// Return the smallest size class that holds size bytes.
+static struct KmemCache *
+kmem_class(size_t size)
+{
+	int i;
+
+	for (i = 0; (size_t) 1 << (KMEM_MIN_SHIFT + i) < size; i++) {
+		;
+	}
+	return &kmem_caches[i];
+}
+
+// Turn the page at va into an empty slab of kc and put it on kc's
+// partial list. The caller holds kmem_lock.
+static void
+slab_init(struct KmemCache *kc, void *va)
+{
+	struct KmemSlab *s = va;
+	char *obj;
+	void **link = &s->ks_free;
+
+	s->ks_cache = kc;
+	s->ks_inuse = 0;
+	s->ks_order = 0;
+	for (obj = (char *) va + KMEM_HDR; obj + kc->kc_size <= (char *) va + PGSIZE;
+		 obj += kc->kc_size) {
+		*link = obj;
+		link = (void **) obj;
+	}
+	*link = NULL;
+
+	s->ks_next = kc->kc_partial;
+	if (s->ks_next) {
+		s->ks_next->ks_pprev = &s->ks_next;
+	}
+	s->ks_pprev = &kc->kc_partial;
+	kc->kc_partial = s;
+	kc->kc_nslabs++;
+}
+
+static void
+slab_unlink(struct KmemSlab *s)
+{
+	*s->ks_pprev = s->ks_next;
+	if (s->ks_next) {
+		s->ks_next->ks_pprev = s->ks_pprev;
+	}
+	s->ks_next = NULL;
+	s->ks_pprev = NULL;
+}
+
+// Fill km with up to KMEM_MAG_BATCH objects from kc's slabs, growing kc
+// by a page at a time as needed.
+static void
+kmem_refill(struct KmemCache *kc, struct KmemMagazine *km)
+{
+	struct KmemSlab *s;
+	struct PageInfo *pp;
+
+	spin_lock(&kmem_lock);
+	while (km->km_count < KMEM_MAG_BATCH) {
+		if ((s = kc->kc_partial) == NULL) {
+			spin_unlock(&kmem_lock);
+			pp = page_alloc(0);
+			spin_lock(&kmem_lock);
+			if (pp == NULL) {
+				break;
+			}
+			slab_init(kc, page2kva(pp));
+			continue;
+		}
+
+		km->km_objs[km->km_count++] = s->ks_free;
+		s->ks_free = *(void **) s->ks_free;
+		s->ks_inuse++;
+		kc->kc_out++;
+		if (s->ks_free == NULL) {
+			slab_unlink(s);
+		}
+	}
+	spin_unlock(&kmem_lock);
+}
+
+// Return the oldest KMEM_MAG_BATCH objects in the full magazine km to
+// their slabs, and give slabs that become empty back to the page
+// allocator.
+static void
+kmem_drain(struct KmemCache *kc, struct KmemMagazine *km)
+{
+	struct KmemSlab *s, *empty = NULL;
+	void *obj;
+	int i;
+
+	spin_lock(&kmem_lock);
+	for (i = 0; i < KMEM_MAG_BATCH; i++) {
+		obj = km->km_objs[i];
+		s = ROUNDDOWN(obj, PGSIZE);
+		if (s->ks_free == NULL) {
+			// Was full; it has room again.
+			s->ks_next = kc->kc_partial;
+			if (s->ks_next) {
+				s->ks_next->ks_pprev = &s->ks_next;
+			}
+			s->ks_pprev = &kc->kc_partial;
+			kc->kc_partial = s;
+		}
+		*(void **) obj = s->ks_free;
+		s->ks_free = obj;
+		s->ks_inuse--;
+		kc->kc_out--;
+		if (s->ks_inuse == 0) {
+			slab_unlink(s);
+			kc->kc_nslabs--;
+			s->ks_next = empty;
+			empty = s;
+		}
+	}
+	spin_unlock(&kmem_lock);
+
+	memmove(km->km_objs, km->km_objs + KMEM_MAG_BATCH,
+		(KMEM_MAG_SIZE - KMEM_MAG_BATCH) * sizeof(km->km_objs[0]));
+	km->km_count -= KMEM_MAG_BATCH;
+
+	while ((s = empty) != NULL) {
+		empty = s->ks_next;
+		page_free(pa2page(PADDR(s)));
+	}
+}
+
+// Allocate a block of whole pages for a request too big for the slabs.
+static void *
+kmalloc_large(size_t size)
+{
+	struct KmemSlab *s;
+	struct PageInfo *pp;
+	int order;
+
+	if (size > (PGSIZE << PAGE_MAX_ORDER) - KMEM_HDR) {
+		return NULL;
+	}
+	for (order = 0; (PGSIZE << order) < size + KMEM_HDR; order++) {
+		;
+	}
+	if (!(pp = page_alloc_order(order, 0))) {
+		return NULL;
+	}
+
+	s = page2kva(pp);
+	s->ks_cache = NULL;
+	s->ks_order = order;
+
+	spin_lock(&kmem_lock);
+	kmem_large_pages += 1 << order;
+	kmem_large_allocs++;
+	spin_unlock(&kmem_lock);
+
+	return (char *) s + KMEM_HDR;
+}
+
+//
+// Allocate size bytes of kernel memory, 16-byte aligned.
+// Returns NULL if size is 0 or if out of memory.
+//
+void *
+kmalloc(size_t size)
+{
+	struct KmemCache *kc;
+	struct KmemMagazine *km;
+
+	if (size == 0) {
+		return NULL;
+	}
+	if (size > KMEM_MAX_SIZE) {
+		return kmalloc_large(size);
+	}
+
+	kc = kmem_class(size);
+	km = &kc->kc_mags[cpunum()];
+	if (km->km_count > 0) {
+		km->km_hits++;
+	} else {
+		km->km_misses++;
+		kmem_refill(kc, km);
+		if (km->km_count == 0) {
+			return NULL;
+		}
+	}
+	return km->km_objs[--km->km_count];
+}
+
+// Like kmalloc, but zero the memory.
+void *
+kzalloc(size_t size)
+{
+	void *p;
+
+	if ((p = kmalloc(size)) != NULL) {
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+//
+// Free memory returned by kmalloc. kfree(NULL) does nothing.
+//
+void
+kfree(void *p)
+{
+	struct KmemSlab *s;
+	struct KmemCache *kc;
+	struct KmemMagazine *km;
+
+	if (p == NULL) {
+		return;
+	}
+
+	s = ROUNDDOWN(p, PGSIZE);
+	if ((kc = s->ks_cache) == NULL) {
+		if ((char *) p != (char *) s + KMEM_HDR) {
+			panic("kfree: bad pointer %08x", p);
+		}
+		spin_lock(&kmem_lock);
+		kmem_large_pages -= 1 << s->ks_order;
+		spin_unlock(&kmem_lock);
+		page_free_order(pa2page(PADDR(s)), s->ks_order);
+		return;
+	}
+
+	if (kc < kmem_caches || kc >= kmem_caches + KMEM_NCLASSES ||
+		((char *) p - (char *) s - KMEM_HDR) % kc->kc_size != 0) {
+		panic("kfree: bad pointer %08x", p);
+	}
+
+	km = &kc->kc_mags[cpunum()];
+	km->km_frees++;
+	if (km->km_count == KMEM_MAG_SIZE) {
+		kmem_drain(kc, km);
+	}
+	km->km_objs[km->km_count++] = p;
+}
+
+// Print each size class's slab use and magazine hit counts.
+void
+kmem_dump_stats(void)
+{
+	struct KmemCache *kc;
+	struct KmemMagazine *km;
+	uint32_t hits, misses, frees, cached;
+	int i, c;
+
+	cprintf(" size  slabs  in use  cached      allocs   hit%%       frees\n");
+	spin_lock(&kmem_lock);
+	for (kc = kmem_caches; kc < kmem_caches + KMEM_NCLASSES; kc++) {
+		hits = misses = frees = cached = 0;
+		for (c = 0; c < ncpu; c++) {
+			km = &kc->kc_mags[c];
+			hits += km->km_hits;
+			misses += km->km_misses;
+			frees += km->km_frees;
+			cached += km->km_count;
+		}
+		cprintf("%5u %6u %7u %7u %11u %5u%% %11u\n", kc->kc_size,
+			kc->kc_nslabs, kc->kc_out - cached, cached, hits + misses,
+			hits + misses ? (uint32_t) ((uint64_t) hits * 100 / (hits + misses)) : 0,
+			frees);
+	}
+	cprintf("large: %u allocs, %u pages in use\n", kmem_large_allocs,
+		kmem_large_pages);
+	spin_unlock(&kmem_lock);
+}
@@ -0,0 +1,12 @@
+#ifndef YUOS_KERN_KMALLOC_H
+#define YUOS_KERN_KMALLOC_H
+
+#include <inc/types.h>
+
+void kmem_init(void);
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *p);
+void kmem_dump_stats(void);
+
+#endif /* !YUOS_KERN_KMALLOC_H */
@@ -29,6 +29,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
 	#define X1         0x0000000B   // divide counts by 1
+	#define ONESHOT    0x00000000   // One-shot
 	#define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -42,6 +43,9 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Timer counts per scheduler tick (10 ms); calibrated by time_init
+uint32_t lapic_timer_ticr = 10000000;
+
 static void
 lapicw(int index, int value)
 {
@@ -63,12 +67,10 @@ lapic_init(void)
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
 	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
-	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	// from lapic[TICR] and then issues an interrupt.
+	// time_init calibrates TICR against the PIT on the boot CPU,
+	// before the APs get here.
+	lapic_timer_periodic();
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -108,6 +110,38 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// Program the timer to interrupt every lapic_timer_ticr counts.
+void
+lapic_timer_periodic(void)
+{
+	if (!lapic)
+		return;
+	lapicw(TDCR, X1);
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, lapic_timer_ticr);
+}
+
+// Program the timer to interrupt once, after 'count' counts.
+// A count of 0 stops the timer.
+void
+lapic_timer_oneshot(uint32_t count)
+{
+	if (!lapic)
+		return;
+	lapicw(TDCR, X1);
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, count);
+}
+
+// Counts left before the timer fires (0 once a one-shot has expired).
+uint32_t
+lapic_timer_count(void)
+{
+	if (!lapic)
+		return 0;
+	return lapic[TCCR];
+}
+
 int
 cpunum(void)
 {
@@ -177,3 +211,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an IPI with 'vector' to the CPU whose local APIC ID is 'apicid'.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
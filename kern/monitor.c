@@ -8,6 +8,12 @@
 
 #include <kern/kdebug.h>
 #include <kern/monitor.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
 
 struct Command {
 	const char *name;
@@ -20,6 +26,10 @@ static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help},
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo},
 	{ "backtrace", "Trace back through the calling stack", mon_backtrace},
+	{ "top", "Display CPU time and resource use per CPU and environment", mon_top},
+	{ "locks", "Display spinlock acquire and contention counts", mon_locks},
+	{ "pages", "Display free pages and per-CPU page cache hit counts", mon_pages},
+	{ "kmem", "Display kmalloc size classes and cache hit rates", mon_kmem},
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -75,6 +85,69 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+static uint32_t
+cycles_to_msec(uint64_t cycles)
+{
+	return time_cycles_to_nsec(cycles) / 1000000;
+}
+
+int
+mon_top(int argc, char **argv, struct Trapframe *tf)
+{
+	static const char * const status[] = {
+		[ENV_FREE] = "free", [ENV_DYING] = "dying",
+		[ENV_RUNNABLE] = "ready", [ENV_RUNNING] = "run",
+		[ENV_NOT_RUNNABLE] = "block",
+	};
+	struct EnvStats *st;
+	struct Env *e;
+	int i;
+
+	sched_account();
+
+	cprintf("CPU    busy ms    idle ms  syscalls   faults    sends    recvs\n");
+	for (i = 0; i < ncpu; i++) {
+		st = &cpus[i].cpu_stats;
+		cprintf("%3d %10u %10u %9u %8u %8u %8u\n", i,
+			cycles_to_msec(st->es_cycles), cycles_to_msec(st->es_idle_cycles),
+			st->es_syscalls, st->es_pgfaults, st->es_ipc_sends, st->es_ipc_recvs);
+	}
+
+	cprintf("\nENV      STAT  CPU PRI    cpu ms  syscalls   faults    sends    recvs  pages\n");
+	for (e = envs; e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE) {
+			continue;
+		}
+		st = &e->env_stats;
+		cprintf("%08x %-5s %3d %3d %9u %9u %8u %8u %8u %6d\n",
+			e->env_id, status[e->env_status], e->env_cpunum, e->env_prio,
+			cycles_to_msec(st->es_cycles), st->es_syscalls, st->es_pgfaults,
+			st->es_ipc_sends, st->es_ipc_recvs, env_npages(e));
+	}
+	return 0;
+}
+
+int
+mon_locks(int argc, char **argv, struct Trapframe *tf)
+{
+	spin_dump_stats();
+	return 0;
+}
+
+int
+mon_pages(int argc, char **argv, struct Trapframe *tf)
+{
+	page_dump_stats();
+	return 0;
+}
+
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_dump_stats();
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n"
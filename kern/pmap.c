@@ -5,10 +5,13 @@
 #include <inc/string.h>
 #include <inc/error.h>
 #include <inc/types.h>
+#include <inc/trap.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -17,7 +20,91 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo	*pages;	// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+bool page_pse;			// CPU supports 4MB pages
+static int pte_global;	// PTE_G if the CPU supports global pages, else 0
+
+#define CPUID_PSE	0x00000008	// CPUID 1 %edx: 4MB pages supported
+#define CPUID_PGE	0x00002000	// CPUID 1 %edx: global pages supported
+
+static uint32_t tlb_nshootdowns;	// TLB shootdowns that reached another CPU
+static uint32_t tlb_nipis;			// IRQ_TLB IPIs sent for them
+
+// Buddy allocator.
+//
+// Free physical memory is kept in blocks of 2^order pages, each aligned
+// to its own size, for orders 0 through PAGE_MAX_ORDER. The first page
+// of a free block has pp_free set and pp_order holding the block's order,
+// and is linked on page_free_list[order] through pp_link and pp_prev.
+// A block's buddy is the other half of the block of twice the size it
+// was split from: page index i ^ (1 << order). Allocation splits the
+// smallest large-enough block; freeing merges the block with its buddy
+// for as long as the buddy is free too, which keeps fragmentation low.
+static struct PageInfo *page_free_list[PAGE_MAX_ORDER + 1];
+static struct spinlock page_lock;		// Protects page_free_list
+
+// Per-CPU page magazines.
+//
+// Each CPU keeps a small stack of free single pages in front of the buddy
+// lists, so that most page_alloc and page_free calls touch only this
+// CPU's magazine and never take page_lock. An empty magazine is refilled,
+// and a full one drained, PAGE_MAG_BATCH pages at a time under a single
+// acquisition of page_lock. The kernel runs with interrupts disabled, so
+// a CPU's magazine is only ever touched by that CPU. Pages in a magazine
+// have pp_cached set; they are free, but only their CPU can allocate them.
+// Another CPU that runs out of memory sets pm_drain to ask for them back
+// (see page_drain).
+#define PAGE_MAG_SIZE	32
+#define PAGE_MAG_BATCH	(PAGE_MAG_SIZE / 2)
+
+static struct PageMagazine {
+	struct PageInfo *pm_pages[PAGE_MAG_SIZE];
+	int pm_count;
+	uint32_t pm_alloc_hits;		// page_alloc served from the magazine
+	uint32_t pm_alloc_misses;	// page_alloc that had to refill it
+	uint32_t pm_free_hits;		// page_free kept in the magazine
+	uint32_t pm_free_misses;	// page_free that had to drain it
+	uint32_t pm_zero_hits;		// ALLOC_ZERO served from page_zero_pool
+	uint32_t pm_zero_misses;	// ALLOC_ZERO that had to zero inline
+	volatile bool pm_drain;		// Give every page back to the buddy lists
+} page_mags[NCPU];
+
+// Pre-zeroed pages.
+//
+// Idle CPUs fill page_zero_pool with up to PAGE_ZERO_MAX zeroed pages
+// (page_zero_idle), so that page_alloc(ALLOC_ZERO) need not clear a page
+// on the syscall or page fault path. The pool is linked through pp_link
+// and protected by page_lock; its pages have pp_cached set. When the rest
+// of memory runs out, page_drain gives the pool back to the buddy lists.
+#define PAGE_ZERO_MAX	64
+
+static struct PageInfo *page_zero_pool;
+static int page_nzero;
+
+// Called by page_alloc and page_alloc_order when memory runs out, to free
+// memory that others hold on to (see page_set_reclaim).
+static int (*page_reclaim)(void);
+
+// Cached page directories.
+//
+// A new env's page directory needs its user part cleared and its kernel
+// part copied from kern_pgdir. env_reclaim clears the user part of a
+// dead env's page directory as it tears it down, so up to
+// PGDIR_CACHE_MAX of those are kept here, linked through pp_link, for
+// pgdir_alloc to hand out again without zeroing a page. The kernel part
+// is copied afresh on every reuse, a few dozen entries, so a cached page
+// directory never misses a change to the kernel's mappings. The cache is
+// protected by page_lock, and its pages have pp_cached set.
+#define PGDIR_CACHE_MAX	16
+
+static struct PageInfo *pgdir_cache;
+static int pgdir_ncache;
+static uint32_t pgdir_cache_hits;		// pgdir_alloc served from the cache
+static uint32_t pgdir_cache_misses;		// pgdir_alloc that took a new page
+
+// The shared zero page: a page of zeros that is never written or freed.
+// Demand-zero memory maps it read-only and copy-on-write (page_map_zero),
+// so that a page is only allocated on the first write.
+struct PageInfo *zero_page;
 
 // -----------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -57,7 +144,11 @@ i386_detect_memory(void)
 // Set up memory mappings above UTOP.
 // -----------------------------------------------------------------
 
+static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void buddy_free(struct PageInfo *pp, int order);
+static void page_release(struct PageInfo *pp, int order);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -115,12 +206,18 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, edx;
 	size_t n;
 
 	// Find out how much memory the machine has (npages & npages_basemem)
 	i386_detect_memory();
 
+	// Can we map memory with 4MB pages, and keep the kernel's
+	// mappings in the TLB across address space switches?
+	cpuid(1, NULL, NULL, NULL, &edx);
+	page_pse = (edx & CPUID_PSE) != 0;
+	pte_global = (edx & CPUID_PGE) ? PTE_G : 0;
+
 	// create initial page directory.
 	kern_pgdir = (pde_t *) boot_alloc(PGSIZE);
 	memset(kern_pgdir, 0, PGSIZE);
@@ -192,8 +289,17 @@ mem_init(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions:	kernel RW, user NONE
+	// Use 4MB pages if we can, which saves the 64 page tables and
+	// most of the TLB entries that this mapping would otherwise take.
 	size = (size_t)(0x100000000 - KERNBASE);
-	boot_map_region(kern_pgdir, KERNBASE, size, 0, PTE_W|PTE_P);
+	if (page_pse) {
+		boot_map_region_large(kern_pgdir, KERNBASE, size, 0, PTE_W|PTE_P);
+	} else {
+		boot_map_region(kern_pgdir, KERNBASE, size, 0, PTE_W|PTE_P);
+	}
+
+	// Initialize the SMP-related parts of the memory map
+	mem_init_mp();
 
 	// Check that the initial page directory has been set up correctly.
 	check_kern_pgdir();
@@ -204,7 +310,8 @@ mem_init(void)
 	// mapped the same way by both page tables.
 	//
 	// If the machine reboots at this point, probably set up kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
+	pgdir_load(kern_pgdir);
 
 	check_page_free_list(0);
 
@@ -217,12 +324,62 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is enablled
 	check_page_installed_pgdir();
+
+	// Allocate the zero page. The reference taken here is never dropped,
+	// so it is never freed, and page_cow_break never makes it writable.
+	if (!(zero_page = page_alloc(ALLOC_ZERO))) {
+		panic("mem_init: no memory for the zero page");
+	}
+	zero_page->pp_ref = 1;
+}
+
+// Turn on the paging features that kern_pgdir relies on. Every CPU
+// calls this before it switches to kern_pgdir.
+void
+mem_init_percpu(void)
+{
+	if (page_pse) {
+		lcr4(rcr4() | CR4_PSE);
+	}
+	if (pte_global) {
+		lcr4(rcr4() | CR4_PGE);
+	}
+}
+
+// Modify mappings in kern_pgdir to support SMP
+//	- Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
+//
+static void
+mem_init_mp(void)
+{
+	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
+	//
+	// For CPU i, use the physical memory that 'percpu_kstacks[i]' refers
+	// to as its kernel stack. CPU i's kernel stack grows down from virtual
+	// address kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and is
+	// divided into two pieces, just like the single stack we set up in
+	// mem_init:
+	//		* [kstacktop_i - KSTKSIZE, kstacktop_i)
+	//			-- backed by physical memory
+	//		* [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+	//			-- not backed; so if the kernel overflows its stack,
+	//			it will fault rather than overwrite another CPU's stack.
+	//			Known as a "guard page".
+	// Permissions: kernel RW, user NONE
+	int i;
+	uintptr_t kstacktop_i;
+
+	for (i = 0; i < NCPU; i++) {
+		kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+		boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE,
+			PADDR(percpu_kstacks[i]), PTE_W|PTE_P);
+	}
 }
 
 // -------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy allocator.
 // --------------------------------------------------------------
 
 //
@@ -248,12 +405,22 @@ page_init(void)
 	//	   page tables and other data structures?
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
+	//
+	// Pages are freed from the top of memory down, so that each free
+	// list starts with its lowest blocks; until mem_init switches to
+	// kern_pgdir, only the low 4MB of physical memory is mapped.
 	size_t i;
-	for (i = 0; i < npages; i++) {
+
+	spin_initlock(&page_lock);
+	for (i = npages; i-- > 0; ) {
 		// page 0
 		if (i == 0) {
 			continue;
 		}
+		// AP bootstrap code, copied there by boot_aps()
+		if (page2pa(&pages[i]) == MPENTRY_PADDR) {
+			continue;
+		}
 		// IO hole
 		if (page2pa(&pages[i]) >= IOPHYSMEM && page2pa(&pages[i]) < EXTPHYSMEM) {
 			continue;
@@ -263,34 +430,246 @@ page_init(void)
 			continue;
 		}
 		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+		buddy_free(&pages[i], 0);
+	}
+}
+
+// Push the free block pp of the given order onto its free list.
+static void
+freelist_push(struct PageInfo *pp, int order)
+{
+	pp->pp_free = 1;
+	pp->pp_order = order;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_list[order];
+	if (pp->pp_link) {
+		pp->pp_link->pp_prev = pp;
+	}
+	page_free_list[order] = pp;
+}
+
+// Unlink the free block pp from its free list.
+static void
+freelist_remove(struct PageInfo *pp)
+{
+	if (pp->pp_prev) {
+		pp->pp_prev->pp_link = pp->pp_link;
+	} else {
+		page_free_list[pp->pp_order] = pp->pp_link;
+	}
+	if (pp->pp_link) {
+		pp->pp_link->pp_prev = pp->pp_prev;
+	}
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_free = 0;
+}
+
+// Take a block of 2^order pages off the free lists, splitting a larger
+// block if necessary. Returns NULL if no block is large enough.
+// The caller holds page_lock.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER; o++) {
+		if (page_free_list[o]) {
+			break;
+		}
+	}
+	if (o > PAGE_MAX_ORDER) {
+		return NULL;
+	}
+
+	pp = page_free_list[o];
+	freelist_remove(pp);
+	// Keep the lower half and give back the upper half at each step.
+	while (o > order) {
+		o--;
+		freelist_push(pp + (1 << o), o);
+	}
+	return pp;
+}
+
+// Return the block of 2^order pages at pp to the free lists, merging it
+// with its buddy as far as possible. The caller holds page_lock.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, b;
+
+	while (order < PAGE_MAX_ORDER) {
+		b = i ^ (1 << order);
+		if (b + (1 << order) > npages || !pages[b].pp_free ||
+			pages[b].pp_order != order) {
+			break;
+		}
+		freelist_remove(&pages[b]);
+		i &= ~(size_t) (1 << order);
+		order++;
+	}
+	freelist_push(&pages[i], order);
+}
+
+// Give every page in this CPU's magazine pm back to the buddy lists.
+static void
+page_mag_drain(struct PageMagazine *pm)
+{
+	struct PageInfo *pp;
+
+	pm->pm_drain = 0;
+	spin_lock(&page_lock);
+	while (pm->pm_count > 0) {
+		pp = pm->pm_pages[--pm->pm_count];
+		pp->pp_cached = 0;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+// Give the free pages held back from the buddy lists back to them, so
+// that they can merge into larger blocks again: this CPU's magazine,
+// page_zero_pool and the cached page directories. The other CPUs'
+// magazines, which only their own CPU may touch, are flagged to be
+// drained the next time that CPU allocates or frees a page.
+static void
+page_drain(void)
+{
+	struct PageInfo *pp;
+	int c;
+
+	for (c = 0; c < ncpu; c++) {
+		if (c != cpunum()) {
+			page_mags[c].pm_drain = 1;
+		}
+	}
+	page_mag_drain(&page_mags[cpunum()]);
+
+	spin_lock(&page_lock);
+	while ((pp = page_zero_pool) != NULL || (pp = pgdir_cache) != NULL) {
+		if (pp == page_zero_pool) {
+			page_zero_pool = pp->pp_link;
+			page_nzero--;
+		} else {
+			pgdir_cache = pp->pp_link;
+			pgdir_ncache--;
+		}
+		pp->pp_link = NULL;
+		pp->pp_cached = 0;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+// Called by page_alloc and page_alloc_order each time they find no free
+// block; 'pass' counts the failures so far. Free pages held back in the
+// magazines and caches are given back first, then once more after the
+// reclaim hook has freed what it can. Returns whether to try again.
+static bool
+page_alloc_retry(int pass)
+{
+	if (pass == 2 || (pass == 1 && !(page_reclaim && page_reclaim()))) {
+		return 0;
 	}
+	page_drain();
+	return 1;
+}
+
+//
+// Register 'reclaim' to be called when page_alloc or page_alloc_order
+// runs out of memory. It frees what memory it can and returns nonzero if
+// it freed any. Since the allocator may call it, page_alloc and
+// page_alloc_order may only be called with the big kernel lock held
+// once it is registered.
+//
+void
+page_set_reclaim(int (*reclaim)(void))
+{
+	page_reclaim = reclaim;
+}
+
+// Take a page from page_zero_pool, or return NULL if it is empty.
+static struct PageInfo *
+page_zero_take(void)
+{
+	struct PageInfo *pp;
+
+	// Peek without the lock first: the pool is usually either full
+	// or, under allocation pressure, empty.
+	if (page_nzero == 0) {
+		return NULL;
+	}
+
+	spin_lock(&page_lock);
+	if ((pp = page_zero_pool) != NULL) {
+		page_zero_pool = pp->pp_link;
+		page_nzero--;
+		pp->pp_link = NULL;
+		pp->pp_cached = 0;
+	}
+	spin_unlock(&page_lock);
+	return pp;
 }
 
 //
 // Allocates a physical page. If (alloc_flags & ALLOC_ZERO), fills the entire
-// returned physical page with '\0' bytes. Does NOT increment the reference
-// count of the page - the caller must do these if necessary (either explicitly
-// or via page_insert).
+// returned physical page with '\0' bytes, or takes an already zeroed page
+// from page_zero_pool. Does NOT increment the reference count of the page -
+// the caller must do these if necessary (either explicitly or via
+// page_insert).
 //
-// Be sure to set the pp_link field of the allocated page to NULL so
-// page_free can check for double-free bugs.
+// The pp_link field of the allocated page is NULL, so page_free can check
+// for double-free bugs.
 //
-// Returns NULL if out of free memory.
+// Returns NULL if out of free memory, even after page_drain and the
+// reclaim hook.
 //
-// Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
+	struct PageMagazine *pm = &page_mags[cpunum()];
 	struct PageInfo *result;
-	if (page_free_list == NULL) {
-		return NULL;
+	int pass;
+
+	if (pm->pm_drain) {
+		page_mag_drain(pm);
 	}
 
-	result = page_free_list;
-	page_free_list = page_free_list->pp_link;
-	result->pp_link = NULL;
+	if (alloc_flags & ALLOC_ZERO) {
+		if ((result = page_zero_take()) != NULL) {
+			pm->pm_zero_hits++;
+			return result;
+		}
+		pm->pm_zero_misses++;
+	}
+
+	if (pm->pm_count > 0) {
+		pm->pm_alloc_hits++;
+	} else {
+		// Refill half the magazine in one go.
+		pm->pm_alloc_misses++;
+		for (pass = 0; ; pass++) {
+			spin_lock(&page_lock);
+			while (pm->pm_count < PAGE_MAG_BATCH) {
+				if (!(result = buddy_alloc(0))) {
+					break;
+				}
+				result->pp_cached = 1;
+				pm->pm_pages[pm->pm_count++] = result;
+			}
+			spin_unlock(&page_lock);
+			if (pm->pm_count > 0) {
+				break;
+			}
+			if (!page_alloc_retry(pass)) {
+				return NULL;
+			}
+		}
+	}
+
+	result = pm->pm_pages[--pm->pm_count];
+	result->pp_cached = 0;
 
 	if (alloc_flags & ALLOC_ZERO) {
 		memset(page2kva(result), 0, PGSIZE);
@@ -299,6 +678,46 @@ page_alloc(int alloc_flags)
 	return result;
 }
 
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// e.g. for DMA. Returns the PageInfo of the first page; the others follow
+// it in pages[]. alloc_flags and reference counts are as for page_alloc.
+// The block must be freed with page_free_order and the same order.
+//
+// Returns NULL if no large enough contiguous block is free, even after
+// page_drain and the reclaim hook.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *result;
+	int pass;
+
+	if (order < 0 || order > PAGE_MAX_ORDER) {
+		return NULL;
+	}
+
+	for (pass = 0; ; pass++) {
+		spin_lock(&page_lock);
+		result = buddy_alloc(order);
+		spin_unlock(&page_lock);
+		if (result != NULL) {
+			break;
+		}
+		// Free pages held back in the magazines and caches cannot merge
+		// into larger blocks.
+		if (!page_alloc_retry(pass)) {
+			return NULL;
+		}
+	}
+
+	if (alloc_flags & ALLOC_ZERO) {
+		memset(page2kva(result), 0, PGSIZE << order);
+	}
+
+	return result;
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -306,19 +725,254 @@ page_alloc(int alloc_flags)
 void
 page_free(struct PageInfo *pp)
 {
+	struct PageMagazine *pm = &page_mags[cpunum()];
+	int i;
+
 	if (pp->pp_ref != 0) {
 		panic("page_free: pp->pp_ref is not 0!");
 	}
-	if (pp->pp_link != NULL) {
-		panic("page_free: pp->pp_link is not NULL!");
+	if (pp->pp_link != NULL || pp->pp_free || pp->pp_cached) {
+		panic("page_free: page is already free!");
+	}
+
+	if (pm->pm_drain) {
+		page_mag_drain(pm);
+	}
+	if (pm->pm_count < PAGE_MAG_SIZE) {
+		pm->pm_free_hits++;
+	} else {
+		// Give the oldest half back to the buddy lists, keeping the
+		// most recently freed pages, which are the likeliest to still
+		// be in this CPU's cache.
+		pm->pm_free_misses++;
+		spin_lock(&page_lock);
+		for (i = 0; i < PAGE_MAG_BATCH; i++) {
+			pm->pm_pages[i]->pp_cached = 0;
+			buddy_free(pm->pm_pages[i], 0);
+		}
+		spin_unlock(&page_lock);
+		memmove(pm->pm_pages, pm->pm_pages + PAGE_MAG_BATCH,
+			(PAGE_MAG_SIZE - PAGE_MAG_BATCH) * sizeof(pm->pm_pages[0]));
+		pm->pm_count -= PAGE_MAG_BATCH;
+	}
+
+	pp->pp_cached = 1;
+	pm->pm_pages[pm->pm_count++] = pp;
+}
+
+//
+// Return a free page that is known to be all zeros, such as a page table
+// whose entries have all been cleared: keep it in page_zero_pool if
+// there is room, or else free it.
+//
+void
+page_free_zeroed(struct PageInfo *pp)
+{
+	if (pp->pp_ref != 0) {
+		panic("page_free_zeroed: pp->pp_ref is not 0!");
 	}
 
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	spin_lock(&page_lock);
+	if (page_nzero < PAGE_ZERO_MAX) {
+		pp->pp_cached = 1;
+		pp->pp_link = page_zero_pool;
+		page_zero_pool = pp;
+		page_nzero++;
+		pp = NULL;
+	}
+	spin_unlock(&page_lock);
+
+	if (pp) {
+		page_free(pp);
+	}
+}
+
+//
+// Allocate a page for a page directory, with nothing mapped below UTOP
+// and the kernel's mappings above it; the UVPT entry is the caller's.
+// Does NOT increment the reference count of the page.
+// Returns NULL if out of free memory.
+//
+struct PageInfo *
+pgdir_alloc(void)
+{
+	struct PageInfo *pp;
+	pde_t *pgdir;
+
+	spin_lock(&page_lock);
+	if ((pp = pgdir_cache) != NULL) {
+		pgdir_cache = pp->pp_link;
+		pgdir_ncache--;
+		pp->pp_link = NULL;
+		pp->pp_cached = 0;
+		pgdir_cache_hits++;
+	} else {
+		pgdir_cache_misses++;
+	}
+	spin_unlock(&page_lock);
+
+	if (!pp && !(pp = page_alloc(ALLOC_ZERO))) {
+		return NULL;
+	}
+
+	pgdir = page2kva(pp);
+	memmove(&pgdir[PDX(UTOP)], &kern_pgdir[PDX(UTOP)],
+		(NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
+	return pp;
+}
+
+//
+// Return a page directory whose reference count has dropped to 0, and
+// in which nothing is mapped below UTOP any more, for pgdir_alloc to
+// reuse.
+//
+void
+pgdir_free(struct PageInfo *pp)
+{
+	if (pp->pp_ref != 0) {
+		panic("pgdir_free: pp->pp_ref is not 0!");
+	}
+
+	spin_lock(&page_lock);
+	if (pgdir_ncache < PGDIR_CACHE_MAX) {
+		pp->pp_cached = 1;
+		pp->pp_link = pgdir_cache;
+		pgdir_cache = pp;
+		pgdir_ncache++;
+		pp = NULL;
+	}
+	spin_unlock(&page_lock);
+
+	if (pp) {
+		page_free(pp);
+	}
+}
+
+//
+// Return the n pages in pps, whose reference counts have all dropped to
+// 0, to the buddy lists with one acquisition of page_lock. This bypasses
+// the per-CPU magazine, which a bulk free would only flush through.
+//
+void
+page_free_bulk(struct PageInfo **pps, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (pps[i]->pp_ref != 0) {
+			panic("page_free_bulk: pp->pp_ref is not 0!");
+		}
+		if (pps[i]->pp_link != NULL || pps[i]->pp_free || pps[i]->pp_cached) {
+			panic("page_free_bulk: page is already free!");
+		}
+	}
+
+	spin_lock(&page_lock);
+	for (i = 0; i < n; i++) {
+		buddy_free(pps[i], 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Zero free pages into page_zero_pool until it is full or this CPU is
+// given work. Called by sched_halt on an idle CPU, without the big kernel
+// lock and with interrupts disabled; a wakeup IPI sent meanwhile stays
+// pending and ends the hlt that follows at once.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+
+	// Take pages straight from the buddy lists: page_alloc may call the
+	// reclaim hook, which needs the big kernel lock.
+	while (page_nzero < PAGE_ZERO_MAX && !thiscpu->cpu_kicked) {
+		spin_lock(&page_lock);
+		pp = buddy_alloc(0);
+		spin_unlock(&page_lock);
+		if (!pp) {
+			return;
+		}
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&page_lock);
+		pp->pp_cached = 1;
+		pp->pp_link = page_zero_pool;
+		page_zero_pool = pp;
+		page_nzero++;
+		spin_unlock(&page_lock);
+	}
+}
+
+//
+// Return a block of 2^order pages allocated by page_alloc_order.
+// Individual pages of a block may also be freed one at a time with
+// page_free; the allocator merges them back as they come in.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if (pp->pp_ref != 0) {
+		panic("page_free: pp->pp_ref is not 0!");
+	}
+	if (pp->pp_link != NULL || pp->pp_free || pp->pp_cached) {
+		panic("page_free: page is already free!");
+	}
+	if ((pp - pages) & ((1 << order) - 1)) {
+		panic("page_free: block is not aligned to its order!");
+	}
+
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
 
 	return;
 }
 
+// Return the number of free pages.
+static size_t
+page_nfree(void)
+{
+	struct PageInfo *pp;
+	size_t n = 0;
+	int o;
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		for (pp = page_free_list[o]; pp; pp = pp->pp_link) {
+			n += 1 << o;
+		}
+	}
+	for (o = 0; o < NCPU; o++) {
+		n += page_mags[o].pm_count;
+	}
+	return n + page_nzero;
+}
+
+// Print the number of free pages and each CPU's magazine counters.
+void
+page_dump_stats(void)
+{
+	struct PageMagazine *pm;
+	int i;
+
+	spin_lock(&page_lock);
+	cprintf("free pages: %u, %d of them zeroed\n", page_nfree(), page_nzero);
+	spin_unlock(&page_lock);
+	cprintf("cpu cached  alloc hits    misses   free hits    misses"
+		"   zero hits    misses\n");
+	for (i = 0; i < ncpu; i++) {
+		pm = &page_mags[i];
+		cprintf("%3d %6d %11u %9u %11u %9u %11u %9u\n", i, pm->pm_count,
+			pm->pm_alloc_hits, pm->pm_alloc_misses,
+			pm->pm_free_hits, pm->pm_free_misses,
+			pm->pm_zero_hits, pm->pm_zero_misses);
+	}
+	cprintf("page directories cached: %d, reused %u of %u\n", pgdir_ncache,
+		pgdir_cache_hits, pgdir_cache_hits + pgdir_cache_misses);
+	cprintf("tlb shootdowns: %u, %u IPIs\n", tlb_nshootdowns, tlb_nipis);
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -328,6 +982,9 @@ page_free(struct PageInfo *pp)
 //
 // Return NULL if there is no page mapped at va.
 //
+// If va lies in a 4MB page, the first page of its block is returned, and
+// the "pte" is the page directory entry, which has PTE_PS set.
+//
 // Hint: uses pgdir_walk and pa2page.
 //
 struct PageInfo *
@@ -368,12 +1025,19 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Look at inc/mmu.h for useful macros that manipulate page table and
 // page directory entries.
 //
+// If va is mapped by a 4MB page, there is no page table, and pgdir_walk
+// returns the page directory entry itself (with PTE_PS set) instead.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	pde_t *pde;
 	pde = &pgdir[PDX(va)];
 
+	if (*pde & PTE_PS) {
+		return pde;
+	}
+
 	if (!(*pde & PTE_P)) {
 		if (create == false) {
 			return NULL;
@@ -421,11 +1085,24 @@ int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	pte_t * pte;
+
+	// A 4MB page at va goes away entirely to make room for a page table.
+	if (pgdir[PDX(va)] & PTE_PS) {
+		page_remove(pgdir, va);
+	}
+
 	pte = pgdir_walk(pgdir, va, true);
 	if (pte == NULL) {
 		return -E_NO_MEM;
 	}
 
+	// Note in the PDE, where the MMU ignores the bit, that this page
+	// table holds shared pages, so that env_free can find them without
+	// scanning every page table (see reclaim_shared in kern/env.c).
+	if (perm & PTE_SHARE) {
+		pgdir[PDX(va)] |= PTE_SHARE;
+	}
+
 	if (*pte & PTE_P) {
 		// the same pp re-inserted at the same
 		// virtual address in the same pgdir
@@ -444,6 +1121,53 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	return 0;
 }
 
+//
+// Map the 4MB block of pages starting at 'pp', allocated with
+// page_alloc_order(PAGE_PSE_ORDER, ...), as a single large page at the
+// 4MB-aligned 'va', with permissions 'perm|PTE_PS|PTE_P'. Whatever was
+// mapped in [va, va+PTSIZE) before is unmapped, including any page table.
+// Only pp's reference count is incremented; it stands for the whole block.
+//
+// RETURNS:
+//	0 on success
+//	-E_NOT_SUPP, if the CPU has no 4MB pages
+//
+int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pt;
+	physaddr_t pa;
+	int i;
+
+	assert(PGOFF(va) == 0 && PTX(va) == 0);
+	if (!page_pse) {
+		return -E_NOT_SUPP;
+	}
+
+	// Take the reference first, in case pp is already mapped here.
+	pp->pp_ref++;
+	if (*pde & PTE_PS) {
+		page_remove(pgdir, va);
+	} else if (*pde & PTE_P) {
+		pa = PTE_ADDR(*pde);
+		pt = (pte_t *) KADDR(pa);
+		tlb_batch_begin();
+		for (i = 0; i < NPTENTRIES; i++) {
+			if (pt[i] & PTE_P) {
+				page_remove(pgdir, va + i * PGSIZE);
+			}
+		}
+		*pde = 0;
+		tlb_invalidate(pgdir, va);
+		page_release(pa2page(pa), 0);
+		tlb_batch_end();
+	}
+
+	*pde = page2pa(pp)|perm|PTE_PS|PTE_P;
+	return 0;
+}
+
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently do nothing.
@@ -462,15 +1186,164 @@ page_remove(pde_t *pgdir, void *va)
 {
 	struct PageInfo *page;
 	pte_t *pte_store;
+	int order;
 
 	page = page_lookup(pgdir, va, &pte_store);
 	if (page == NULL) {
 		return;
 	}
 
+	// A 4MB page goes back as a whole block. Another CPU may use the
+	// old entry until the shootdown is done, so only then free it.
+	order = (*pte_store & PTE_PS) ? PAGE_PSE_ORDER : 0;
 	*pte_store = 0;
-	page_decref(page);
 	tlb_invalidate(pgdir, va);
+	page_release(page, order);
+}
+
+//
+// Resolve a write to the copy-on-write page at va in pgdir: map a private,
+// writable copy of it there, or, if no other mapping of the page is left,
+// just make it writable.
+//
+// RETURNS:
+//	0 on success
+//	-E_INVAL, if va is not mapped copy-on-write
+//	-E_NO_MEM, if there's no memory for the copy
+//
+int
+page_cow_break(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *np;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pp = page_lookup(pgdir, va, &pte);
+	if (pp == NULL || (*pte & PTE_PS) || !(*pte & PTE_COW)) {
+		return -E_INVAL;
+	}
+
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp)|perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (pp == zero_page) {
+		if (!(np = page_alloc(ALLOC_ZERO))) {
+			return -E_NO_MEM;
+		}
+	} else {
+		if (!(np = page_alloc(0))) {
+			return -E_NO_MEM;
+		}
+		memmove(page2kva(np), page2kva(pp), PGSIZE);
+	}
+	if ((r = page_insert(pgdir, np, va, perm)) < 0) {
+		page_free(np);
+	}
+	return r;
+}
+
+//
+// Map the shared zero page at 'va' as demand-zero memory: read-only,
+// and copy-on-write if perm includes PTE_W, so that the first write
+// gives the environment a zeroed page of its own. Whatever was mapped
+// at va before is unmapped.
+//
+// RETURNS:
+//	0 on success
+//	-E_NO_MEM, if a page table couldn't be allocated
+//
+int
+page_map_zero(pde_t *pgdir, void *va, int perm)
+{
+	if (perm & PTE_W) {
+		perm = (perm & ~PTE_W) | PTE_COW;
+	}
+	return page_insert(pgdir, zero_page, va, perm);
+}
+
+// Give dst its own copy of the 4MB page that pde maps at va. There is
+// no copy-on-write for 4MB pages, so a writable one is copied now; one
+// that is read-only or PTE_SHARE is shared.
+static int
+pgdir_copy_large(pde_t *dst, pde_t pde, void *va)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(pde));
+	int r;
+
+	if (!(pde & PTE_W) || (pde & PTE_SHARE)) {
+		return page_insert_large(dst, pp, va, pde & PTE_SYSCALL);
+	}
+
+	if (!(pp = page_alloc_order(PAGE_PSE_ORDER, 0))) {
+		return -E_NO_MEM;
+	}
+	memcpy(page2kva(pp), KADDR(PTE_ADDR(pde)), PTSIZE);
+	if ((r = page_insert_large(dst, pp, va, pde & PTE_SYSCALL)) < 0) {
+		page_free_order(pp, PAGE_PSE_ORDER);
+	}
+	return r;
+}
+
+//
+// Copy the user part of the address space src into dst, which must have
+// nothing mapped below UTOP, for fork. Writable and copy-on-write pages
+// become copy-on-write in both; PTE_SHARE pages and read-only pages are
+// shared as they are. Writable 4MB pages are copied for dst at once (see
+// pgdir_copy_large). The user exception stack is not copied:
+// the kernel writes to it directly, so it must never be copy-on-write.
+//
+// The pages of src that became copy-on-write are shot down in one batch.
+//
+// RETURNS:
+//	0 on success
+//	-E_NO_MEM, if a page table or a 4MB page couldn't be allocated
+//
+int
+pgdir_copy_cow(pde_t *dst, pde_t *src)
+{
+	uint32_t pdeno, pteno;
+	pte_t *pt;
+	void *va;
+	int perm, r = 0;
+
+	tlb_batch_begin();
+	for (pdeno = 0; pdeno < PDX(UTOP) && r == 0; pdeno++) {
+		if (!(src[pdeno] & PTE_P)) {
+			continue;
+		}
+		va = PGADDR(pdeno, 0, 0);
+		if (src[pdeno] & PTE_PS) {
+			r = pgdir_copy_large(dst, src[pdeno], va);
+			continue;
+		}
+
+		pt = (pte_t *) KADDR(PTE_ADDR(src[pdeno]));
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			va = PGADDR(pdeno, pteno, 0);
+			if (!(pt[pteno] & PTE_P) || va == (void *) (UXSTACKTOP - PGSIZE)) {
+				continue;
+			}
+			perm = pt[pteno] & PTE_SYSCALL;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				if (pt[pteno] & PTE_W) {
+					pt[pteno] = PTE_ADDR(pt[pteno])|perm;
+					tlb_invalidate(src, va);
+				}
+			}
+			if ((r = page_insert(dst, pa2page(PTE_ADDR(pt[pteno])), va, perm)) < 0) {
+				break;
+			}
+		}
+	}
+
+	tlb_batch_end();
+	return r;
 }
 
 //
@@ -486,15 +1359,221 @@ page_decref(struct PageInfo* pp)
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Load pgdir into %cr3 on this CPU. cpu_pgdir records it for
+// tlb_shootdown, which only bothers the CPUs that have the page
+// directory being changed loaded.
+//
+void
+pgdir_load(pde_t *pgdir)
+{
+	thiscpu->cpu_pgdir = pgdir;
+	lcr3(PADDR(pgdir));
+}
+
+// TLB shootdown.
+//
+// When the kernel changes a mapping, every CPU that has the page
+// directory loaded may have the old one cached in its TLB. tlb_shootdown
+// flushes it here and posts a request in the cpu_tlb mailbox of each
+// other such CPU. Page tables only change under the big kernel lock, so
+// there is one shootdown at a time, and a mailbox is only ever written
+// by it and by its own CPU.
+//
+// A CPU running user code (cpu_user) gets an IRQ_TLB IPI, and we wait for
+// it to carry out the request, since the env may be using the old page.
+// A CPU in the kernel cannot take the IPI, as the kernel runs with
+// interrupts disabled, and may well be spinning on the lock we hold; we
+// don't wait for it. It calls tlb_shootdown_poll on the way back to user
+// mode and after taking the big kernel lock. Both sides set their flag
+// with xchg before reading the other's, so either we see cpu_user set
+// or that CPU sees our request.
+
+// Between tlb_batch_begin and tlb_batch_end, tlb_invalidate only notes
+// the page, and page_release holds back the pages whose last mapping went
+// away, so that a run of changes to one page directory costs a single
+// shootdown. The batch is flushed early when it fills up or moves on to
+// another page directory.
+static struct {
+	int tb_depth;
+	pde_t *tb_pgdir;
+	int tb_nva;						// > TLB_BATCH_MAX: flush everything
+	uintptr_t tb_va[TLB_BATCH_MAX];
+	int tb_nfree;
+	struct PageInfo *tb_free[TLB_BATCH_MAX];
+	uint8_t tb_order[TLB_BATCH_MAX];
+} tlb_batch;
+
+// Flush the nva pages at va from this CPU's TLB, or all of the user
+// entries if nva > TLB_BATCH_MAX.
+static void
+tlb_flush(const uintptr_t *va, int nva)
+{
+	int i;
+
+	if (nva > TLB_BATCH_MAX) {
+		lcr3(rcr3());
+		return;
+	}
+	for (i = 0; i < nva; i++) {
+		invlpg((void *) va[i]);
+	}
+}
+
+static void
+tlb_shootdown(pde_t *pgdir, const uintptr_t *va, int nva)
+{
+	struct CpuInfo *c;
+	struct TlbShootdown *ts;
+	uint32_t req[NCPU];
+	bool wait[NCPU];
+	bool sent = 0;
+
+	if (thiscpu->cpu_pgdir == pgdir) {
+		tlb_flush(va, nva);
+	}
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		wait[c - cpus] = 0;
+		if (c == thiscpu || c->cpu_pgdir != pgdir) {
+			continue;
+		}
+
+		// The CPU may not have got to the last request yet; then it
+		// could be reading ts_va, so leave it be and let the missed
+		// request turn both into a full flush.
+		ts = &c->cpu_tlb;
+		req[c - cpus] = ts->ts_req + 1;
+		if (ts->ts_done == ts->ts_req) {
+			ts->ts_nva = nva;
+			if (nva <= TLB_BATCH_MAX) {
+				memmove(ts->ts_va, va, nva * sizeof(va[0]));
+			}
+			ts->ts_va_req = req[c - cpus];
+		}
+		xchg(&ts->ts_req, req[c - cpus]);
+		sent = 1;
+
+		if (c->cpu_user) {
+			lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TLB);
+			wait[c - cpus] = 1;
+			tlb_nipis++;
+		}
+	}
+	if (sent) {
+		tlb_nshootdowns++;
+	}
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (!wait[c - cpus]) {
+			continue;
+		}
+		while ((int32_t) (c->cpu_tlb.ts_done - req[c - cpus]) < 0 &&
+			c->cpu_user) {
+			asm volatile("pause");
+		}
+	}
+}
+
+//
+// Carry out the TLB flushes that other CPUs have posted to this one.
+//
+void
+tlb_shootdown_poll(void)
+{
+	struct TlbShootdown *ts = &thiscpu->cpu_tlb;
+	uint32_t req = ts->ts_req;
+
+	if (req == ts->ts_done) {
+		return;
+	}
+	if (ts->ts_va_req == req) {
+		tlb_flush(ts->ts_va, ts->ts_nva);
+	} else {
+		tlb_flush(NULL, TLB_BATCH_MAX + 1);
+	}
+	// Only now may tlb_shootdown rewrite ts_va.
+	xchg(&ts->ts_done, req);
+}
+
+// Shoot down the pages noted in the batch, then free the pages held back.
+static void
+tlb_batch_flush(void)
+{
+	int i;
+
+	if (tlb_batch.tb_nva > 0) {
+		tlb_shootdown(tlb_batch.tb_pgdir, tlb_batch.tb_va, tlb_batch.tb_nva);
+		tlb_batch.tb_nva = 0;
+	}
+	for (i = 0; i < tlb_batch.tb_nfree; i++) {
+		page_free_order(tlb_batch.tb_free[i], tlb_batch.tb_order[i]);
+	}
+	tlb_batch.tb_nfree = 0;
+}
+
+void
+tlb_batch_begin(void)
+{
+	tlb_batch.tb_depth++;
+}
+
+void
+tlb_batch_end(void)
+{
+	assert(tlb_batch.tb_depth > 0);
+	if (--tlb_batch.tb_depth == 0) {
+		tlb_batch_flush();
+	}
+}
+
+//
+// Drop a reference to pp, a block of 2^order pages that was just
+// unmapped, and free it if that was the last. Inside a TLB batch, the
+// free waits until the batch is shot down.
+//
+static void
+page_release(struct PageInfo *pp, int order)
+{
+	if (--pp->pp_ref > 0) {
+		return;
+	}
+	if (tlb_batch.tb_depth == 0) {
+		page_free_order(pp, order);
+		return;
+	}
+	if (tlb_batch.tb_nfree == TLB_BATCH_MAX) {
+		tlb_batch_flush();
+	}
+	tlb_batch.tb_free[tlb_batch.tb_nfree] = pp;
+	tlb_batch.tb_order[tlb_batch.tb_nfree++] = order;
+}
+
+//
+// Invalidate a TLB entry on every CPU that may be using the page tables
+// being edited.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	// For now, there is only one address space, so always invalidate.
-	invlpg(va);
+	uintptr_t a = (uintptr_t) ROUNDDOWN(va, PGSIZE);
+
+	if (tlb_batch.tb_depth == 0) {
+		tlb_shootdown(pgdir, &a, 1);
+		return;
+	}
+
+	if (tlb_batch.tb_pgdir != pgdir) {
+		tlb_batch_flush();
+		tlb_batch.tb_pgdir = pgdir;
+	}
+	if (tlb_batch.tb_nva < TLB_BATCH_MAX) {
+		if (tlb_batch.tb_nva == 0 || tlb_batch.tb_va[tlb_batch.tb_nva - 1] != a) {
+			tlb_batch.tb_va[tlb_batch.tb_nva++] = a;
+		}
+	} else {
+		// Past this many pages, one full flush beats the invlpgs.
+		tlb_batch.tb_nva = TLB_BATCH_MAX + 1;
+	}
 }
 
 //
@@ -545,6 +1624,10 @@ mmio_map_region(physaddr_t pa, size_t size) {
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages
 //
+// These mappings are the same in every address space, so they are made
+// global (PTE_G) where the CPU supports it: their TLB entries then
+// survive the lcr3 of an environment switch.
+//
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
@@ -553,7 +1636,29 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 
 	for (i = 0; i < size; i += PGSIZE) {
 		pte = pgdir_walk(pgdir, (void*) va + i, true);
-		*pte = (pa + i)|perm|PTE_P;
+		*pte = (pa + i)|perm|pte_global|PTE_P;
+	}
+}
+
+//
+// Like boot_map_region, but map with 4MB pages wherever va and pa are
+// both 4MB-aligned, and with 4KB pages elsewhere. The CPU must support
+// PSE (page_pse).
+//
+static void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	size_t i, n;
+
+	for (i = 0; i < size; i += n) {
+		if ((va + i) % PTSIZE == 0 && (pa + i) % PTSIZE == 0 &&
+			size - i >= PTSIZE) {
+			pgdir[PDX(va + i)] = (pa + i)|perm|pte_global|PTE_PS|PTE_P;
+			n = PTSIZE;
+		} else {
+			boot_map_region(pgdir, va + i, PGSIZE, pa + i, perm);
+			n = PGSIZE;
+		}
 	}
 }
 
@@ -589,7 +1694,7 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 		if ((uint32_t)addr >= ULIM) {
 			goto fail;
 		}
-		pte = pgdir_walk(env->env_pgdir, va, 0);
+		pte = pgdir_walk(env->env_pgdir, addr, 0);
 		if (pte == NULL) {
 			goto fail;
 		}
@@ -622,22 +1727,150 @@ fail:
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
+	bool locked;
+	void *addr;
+
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
+		// System calls that run without the big kernel lock
+		// (see syscall_unlocked) need it to change page tables
+		// or destroy an env.
+		if ((locked = !spin_holding(&kernel_lock))) {
+			lock_kernel();
+		}
+
+		// The kernel writes on env's behalf where env could: break
+		// copy-on-write pages in the range, as a write fault would.
+		if (perm & PTE_W) {
+			for (addr = ROUNDDOWN((void *) va, PGSIZE); addr < va + len;
+				 addr += PGSIZE) {
+				page_cow_break(env->env_pgdir, addr);
+			}
+			if (user_mem_check(env, va, len, perm | PTE_U) == 0) {
+				if (locked) {
+					unlock_kernel();
+				}
+				return;
+			}
+		}
+
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
 		env_destroy(env);		// may not return
+		if (locked) {
+			unlock_kernel();
+		}
 	}
 }
 
-void
+//
+// Store in *pa_store the physical address that user address va maps to
+// in curenv. Returns 0, or -E_FAULT if va is not a mapped user page.
+//
+int
 user_mem_phy_addr(uintptr_t va, physaddr_t *pa_store)
 {
 	struct PageInfo *pp;
+	pte_t *pte;
 
-	pp = page_lookup(curenv->env_pgdir, (void *)va, 0);
-	*pa_store = page2pa(pp) | PGOFF(va);
+	if (va >= UTOP) {
+		return -E_FAULT;
+	}
+	pp = page_lookup(curenv->env_pgdir, (void *)va, &pte);
+	if (pp == NULL || !(*pte & PTE_U)) {
+		return -E_FAULT;
+	}
+	if (*pte & PTE_PS) {
+		*pa_store = page2pa(pp) | (va & (PTSIZE - 1));
+	} else {
+		*pa_store = page2pa(pp) | PGOFF(va);
+	}
 
-	return;
+	return 0;
+}
+
+// Copying to and from user memory.
+//
+// Rather than walk the page tables to check a user buffer before using
+// it, copyin and copyout only check that it lies below UTOP and copy it
+// with the MMU doing the rest of the checking. Everything mapped below
+// UTOP is mapped PTE_U, so the kernel, whose own accesses ignore PTE_U,
+// faults exactly where the environment would (with CR0_WP, on writes to
+// read-only pages too). Above UTOP that no longer holds: the page tables
+// at UVPT, for one, are mapped where the environment cannot read them.
+// The copy instruction is listed in the fault fixup table, the
+// __ex_table section (see kern/kernel.ld), so that a page fault on it
+// resumes at the fixup code, which returns -E_FAULT, instead of
+// panicking the kernel (see page_fault_handler). A write to a copy-on-write page is resolved by
+// the fault handler, just as if the environment had made it.
+
+extern const struct ExTableEntry __EX_TABLE_BEGIN__[], __EX_TABLE_END__[];
+
+//
+// Return where a kernel page fault at eip should resume, or 0 if eip
+// is not allowed to fault.
+//
+uintptr_t
+ex_table_fixup(uintptr_t eip)
+{
+	const struct ExTableEntry *ex;
+
+	for (ex = __EX_TABLE_BEGIN__; ex < __EX_TABLE_END__; ex++) {
+		if (ex->ex_insn == eip) {
+			return ex->ex_fixup;
+		}
+	}
+	return 0;
+}
+
+static int
+copy_user(void *dst, const void *src, size_t len)
+{
+	int r;
+
+	asm volatile("1:	rep movsb\n"
+		"	xorl %0, %0\n"
+		"	jmp 3f\n"
+		"2:	movl %4, %0\n"
+		"3:\n"
+		"	.pushsection __ex_table, \"a\"\n"
+		"	.long 1b, 2b\n"
+		"	.popsection"
+		: "=a" (r), "+D" (dst), "+S" (src), "+c" (len)
+		: "i" (-E_FAULT)
+		: "cc", "memory");
+	return r;
+}
+
+//
+// Copy len bytes from curenv's memory at usrc to dst.
+// Returns 0, or -E_FAULT if [usrc, usrc+len) is not readable by the
+// environment; part of dst may have been written then.
+//
+int
+copyin(void *dst, const void *usrc, size_t len)
+{
+	uintptr_t va = (uintptr_t) usrc;
+
+	if (va + len < va || va + len > UTOP) {
+		return -E_FAULT;
+	}
+	return copy_user(dst, usrc, len);
+}
+
+//
+// Copy len bytes from src to curenv's memory at udst.
+// Returns 0, or -E_FAULT if [udst, udst+len) is not writable by the
+// environment; part of it may have been written then.
+//
+int
+copyout(void *udst, const void *src, size_t len)
+{
+	uintptr_t va = (uintptr_t) udst;
+
+	if (va + len < va || va + len > UTOP) {
+		return -E_FAULT;
+	}
+	return copy_user(udst, src, len);
 }
 
 void
@@ -668,56 +1901,73 @@ user_mem_page_replace(uintptr_t va, struct PageInfo *pt)
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *bp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int o;
 
-	if (!page_free_list) {
-		panic("'page_free_list' is a null pointer!");
+	if (page_nfree() == 0) {
+		panic("'page_free_list' is empty!");
 	}
 
 	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
+		// Move blocks with lower addresses first in each free
 		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
+		for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+			struct PageInfo *pp1, *pp2;
+			struct PageInfo **tp[2] = { &pp1, &pp2 };
+			for (pp = page_free_list[o]; pp; pp = pp->pp_link) {
+				int pagetype = PDX(page2pa(pp)) >= pdx_limit;
+				*tp[pagetype] = pp;
+				tp[pagetype] = &pp->pp_link;
+			}
+			*tp[1] = 0;
+			*tp[0] = pp2;
+			page_free_list[o] = pp1;
+			for (bp = NULL, pp = pp1; pp; bp = pp, pp = pp->pp_link) {
+				pp->pp_prev = bp;
+			}
 		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
 	}
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		if (PDX(page2pa(pp)) < pdx_limit) {
-			memset(page2kva(pp), 0x97, 128);
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		for (bp = page_free_list[o]; bp; bp = bp->pp_link) {
+			for (pp = bp; pp < bp + (1 << o); pp++) {
+				if (PDX(page2pa(pp)) < pdx_limit) {
+					memset(page2kva(pp), 0x97, 128);
+				}
+			}
 		}
 	}
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-
-		if (page2pa(pp) < EXTPHYSMEM) {
-			++nfree_basemem;
-		} else {
-			++nfree_extmem;
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		for (bp = page_free_list[o]; bp; bp = bp->pp_link) {
+			// check that we didn't corrupt the free list itself
+			assert(bp >= pages);
+			assert(bp + (1 << o) <= pages + npages);
+			assert(((char *) bp - (char *) pages) % sizeof(*bp) == 0);
+			assert(bp->pp_free && bp->pp_order == o);
+			assert(((bp - pages) & ((1 << o) - 1)) == 0);
+			assert(bp->pp_link == NULL || bp->pp_link->pp_prev == bp);
+
+			for (pp = bp; pp < bp + (1 << o); pp++) {
+				// check a few pages that shouldn't be on the free list
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+
+				if (page2pa(pp) < EXTPHYSMEM) {
+					++nfree_basemem;
+				} else {
+					++nfree_extmem;
+				}
+			}
 		}
 	}
 
@@ -727,6 +1977,33 @@ check_page_free_list(bool only_low_memory)
 	cprintf("check_page_free_list(%d) succeeded!\n", only_low_memory ? 1 : 0);
 }
 
+// Allocate every free page, for checks that need the allocator to be
+// out of memory, and return them linked through pp_link.
+static struct PageInfo *
+steal_free_pages(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+
+	while ((pp = page_alloc(0)) != NULL) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+// Free the pages taken by steal_free_pages.
+static void
+return_free_pages(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl) != NULL) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -745,9 +2022,7 @@ check_page_alloc(void)
 	}
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link) {
-		++nfree;
-	}
+	nfree = page_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -763,8 +2038,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -793,7 +2067,7 @@ check_page_alloc(void)
 	}
 
 	// give free list back
-	page_free_list = fl;
+	return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -801,10 +2075,24 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		--nfree;
-	}
-	assert(nfree == 0);
+	assert(page_nfree() == nfree);
+
+	// contiguous blocks are aligned to their size, and split and merge
+	assert((pp0 = page_alloc_order(3, 0)));
+	assert(((pp0 - pages) & 7) == 0);
+	assert(page_nfree() == nfree - 8);
+	assert((pp1 = page_alloc_order(0, 0)));
+	assert(pp1 < pp0 || pp1 >= pp0 + 8);
+	page_free(pp1);
+	page_free_order(pp0, 3);
+	assert(page_nfree() == nfree);
+	assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+
+	// a block can be given back one page at a time
+	assert((pp0 = page_alloc_order(1, 0)));
+	page_free(pp0 + 1);
+	page_free(pp0);
+	assert(page_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -831,8 +2119,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -953,7 +2240,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -976,6 +2263,9 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	if (!(*pgdir & PTE_P)) {
 		return ~0;
 	}
+	if (*pgdir & PTE_PS) {
+		return PTE_ADDR(*pgdir) + (va & (PTSIZE - 1) & ~(PGSIZE - 1));
+	}
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P)) {
 		return ~0;
@@ -1018,10 +2308,17 @@ check_kern_pgdir(void)
 	}
 
 	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE) {
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+	// (one stack per CPU, each below its own guard gap)
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE) {
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+		}
+		for (i = 0; i < KSTKGAP; i += PGSIZE) {
+			assert(check_va2pa(pgdir, base + i) == ~0);
+		}
 	}
-	assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
 
 	// check PDE permissions
 	for (i = 0; i < NPDENTRIES; i++) {
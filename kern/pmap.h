@@ -11,6 +11,7 @@ extern struct PageInfo *pages;
 extern size_t npages;
 
 extern pde_t *kern_pgdir;
+extern struct PageInfo *zero_page;
 
 /* This macro takes a kernel virtual address -- an address that points above
  * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
@@ -42,21 +43,48 @@ _kaddr(const char *file, int line, physaddr_t pa)
 	return (void *)(pa + KERNBASE);
 }
 
+// Largest block page_alloc_order can return: 2^10 pages, 4MB
+#define PAGE_MAX_ORDER	10
+
+// Order of the block behind a 4MB (PTE_PS) large page
+#define PAGE_PSE_ORDER	(PTSHIFT - PGSHIFT)
+
+// Whether the CPU supports 4MB pages; if so, mem_init_percpu enables them.
+extern bool page_pse;
+
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
 };
 
 void mem_init(void);
+void mem_init_percpu(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void page_free_order(struct PageInfo *pp, int order);
+void page_set_reclaim(int (*reclaim)(void));
+void page_free_bulk(struct PageInfo **pps, int n);
+void page_free_zeroed(struct PageInfo *pp);
+struct PageInfo *pgdir_alloc(void);
+void pgdir_free(struct PageInfo *pp);
+void page_dump_stats(void);
+void page_zero_idle(void);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 int page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int page_cow_break(pde_t *pgdir, void *va);
+int page_map_zero(pde_t *pgdir, void *va, int perm);
+int pgdir_copy_cow(pde_t *dst, pde_t *src);
 void page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void page_decref(struct PageInfo *pp);
 
+void pgdir_load(pde_t *pgdir);
 void tlb_invalidate(pde_t *pgdir, void *va);
+void tlb_batch_begin(void);
+void tlb_batch_end(void);
+void tlb_shootdown_poll(void);
 
 void page_init(void);
 
@@ -64,7 +92,18 @@ void * mmio_map_region(physaddr_t pa, size_t size);
 
 void user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 int user_mem_check(struct Env *env, const void *va, size_t len, int perm);
-void user_mem_phy_addr(uintptr_t va, physaddr_t *pa_store);
+int user_mem_phy_addr(uintptr_t va, physaddr_t *pa_store);
+int copyin(void *dst, const void *usrc, size_t len);
+int copyout(void *udst, const void *src, size_t len);
+
+// An entry of the kernel's fault fixup table (see copyin): a page fault
+// on a user address at instruction ex_insn resumes at ex_fixup.
+struct ExTableEntry {
+	uintptr_t ex_insn;
+	uintptr_t ex_fixup;
+};
+
+uintptr_t ex_table_fixup(uintptr_t eip);
 void user_mem_page_replace(uintptr_t va, struct PageInfo *pt);
 
 static inline physaddr_t
@@ -5,19 +5,25 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
 static void
 putch(int ch, int *cnt)
 {
-	cputchar(ch);
+	cons_putc(ch);
 	*cnt++;
 }
 
+// Print the whole message under the console lock, so that messages
+// from different CPUs do not interleave.
 int 
 vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
+	bool locked = lock_console();
 
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	unlock_console(locked);
 	return cnt;
 }
 
@@ -1,34 +1,454 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/trap.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+
+void sched_halt(void) __attribute__((noreturn));
+
+// Run queues.
+//
+// Every CPU owns NENVPRIO FIFOs of ENV_RUNNABLE environments, one per
+// priority level, threaded through env_rq_next/env_rq_prev. An env is on
+// exactly one run queue iff its status is ENV_RUNNABLE; env_rq_cpu names
+// the CPU and env_prio the level. Status changes go through
+// env_set_status(), which keeps the queues in sync, so both enqueue and
+// dequeue are O(1) regardless of NENV.
+//
+// Priorities follow a multilevel feedback policy:
+//	- An env that uses up its whole time slice (SCHED_QUANTUM ticks of
+//	  its level) is demoted one level; lower levels get longer slices.
+//	- An env woken by IPC goes back to its base priority, so servers
+//	  and clients that mostly block stay ahead of CPU hogs.
+//	- Every SCHED_BOOST_TICKS ticks each CPU returns the envs on its
+//	  queues to their base priority, so demoted envs cannot starve.
+//
+// Placement respects each env's affinity mask (env_affinity): an env
+// is only ever queued on, stolen by, or run on a CPU its mask allows.
+// A runnable env is queued on the CPU it last ran on (env_cpunum) when
+// possible, where its working set is likely still in the cache, and
+// otherwise on the waking CPU or the first CPU it is allowed on.
+//
+// The run queues are protected by the big kernel lock.
+
+// Time slice, in timer ticks, of an env at priority 'prio'
+#define SCHED_QUANTUM(prio)		(1 << (prio))
+// Period, in timer ticks, of the anti-starvation priority boost
+#define SCHED_BOOST_TICKS		100
+
+// Append e to the tail of its priority's queue on cpu.
+static void
+runq_push(struct CpuInfo *cpu, struct Env *e)
+{
+	struct RunQueue *rq = &cpu->cpu_runq;
+	int p = e->env_prio;
+
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail[p];
+	if (rq->rq_tail[p]) {
+		rq->rq_tail[p]->env_rq_next = e;
+	} else {
+		rq->rq_head[p] = e;
+	}
+	rq->rq_tail[p] = e;
+	rq->rq_len++;
+	e->env_rq_cpu = cpu - cpus;
+}
+
+// Unlink e from the run queue it is on.
+static void
+runq_remove(struct Env *e)
+{
+	struct RunQueue *rq = &cpus[e->env_rq_cpu].cpu_runq;
+	int p = e->env_prio;
+
+	if (e->env_rq_prev) {
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	} else {
+		rq->rq_head[p] = e->env_rq_next;
+	}
+	if (e->env_rq_next) {
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	} else {
+		rq->rq_tail[p] = e->env_rq_prev;
+	}
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+	rq->rq_len--;
+}
+
+// Return the best (lowest) priority level with a queued env on rq,
+// or NENVPRIO if rq is empty.
+static int
+runq_best(struct RunQueue *rq)
+{
+	int p;
+
+	for (p = 0; p < NENVPRIO; p++) {
+		if (rq->rq_head[p]) {
+			break;
+		}
+	}
+	return p;
+}
+
+// Can e run on cpu?
+static bool
+cpu_allowed(struct Env *e, struct CpuInfo *cpu)
+{
+	return (e->env_affinity >> (cpu - cpus)) & 1;
+}
+
+// Pick the CPU whose run queue e should go on.
+static struct CpuInfo *
+sched_place(struct Env *e)
+{
+	struct CpuInfo *c;
+
+	if (e->env_cpunum >= 0 && e->env_cpunum < ncpu &&
+		cpu_allowed(e, &cpus[e->env_cpunum])) {
+		return &cpus[e->env_cpunum];
+	}
+	if (cpu_allowed(e, thiscpu)) {
+		return thiscpu;
+	}
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (cpu_allowed(e, c)) {
+			return c;
+		}
+	}
+	panic("sched_place: env %08x may not run on any CPU", e->env_id);
+}
+
+// Send a wakeup IPI to cpu if it is idle. cpu_kicked stops us from
+// sending more IPIs to a CPU that has not woken up from the first one.
+static bool
+sched_kick(struct CpuInfo *cpu)
+{
+	if (cpu == thiscpu || cpu->cpu_status != CPU_HALTED || cpu->cpu_kicked) {
+		return 0;
+	}
+	cpu->cpu_kicked = 1;
+	lapic_ipi_cpu(cpu->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+	return 1;
+}
+
+// Make e eligible to run by putting it on a run queue, and wake a CPU
+// to run it. Idle CPUs have their timers stopped (see time_idle), so
+// without the IPI they would sleep until the next device interrupt. If
+// e's own CPU is busy, wake an idle CPU e may run on to steal it.
+// e's status must already be ENV_RUNNABLE.
+void
+sched_enqueue(struct Env *e)
+{
+	struct CpuInfo *cpu, *c;
+
+	assert(e->env_status == ENV_RUNNABLE);
+	cpu = sched_place(e);
+	runq_push(cpu, e);
+	if (sched_kick(cpu)) {
+		return;
+	}
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (cpu_allowed(e, c) && sched_kick(c)) {
+			return;
+		}
+	}
+}
+
+// Take e off its run queue. e's status must still be ENV_RUNNABLE.
+void
+sched_dequeue(struct Env *e)
+{
+	assert(e->env_status == ENV_RUNNABLE && e->env_rq_cpu >= 0);
+	runq_remove(e);
+}
+
+// Set e's current priority, requeueing it if it is runnable.
+static void
+sched_set_prio(struct Env *e, int prio)
+{
+	struct CpuInfo *cpu;
+
+	if (e->env_status == ENV_RUNNABLE) {
+		cpu = &cpus[e->env_rq_cpu];
+		runq_remove(e);
+		e->env_prio = prio;
+		runq_push(cpu, e);
+	} else {
+		e->env_prio = prio;
+	}
+	e->env_slice = 0;
+}
+
+// Return e to its base priority, e.g. when it wakes up from IPC.
+void
+sched_boost(struct Env *e)
+{
+	sched_set_prio(e, e->env_base_prio);
+}
+
+// Set both e's base and current priority.
+void
+sched_set_priority(struct Env *e, int prio)
+{
+	e->env_base_prio = prio;
+	sched_set_prio(e, prio);
+}
+
+// Periodic anti-starvation boost: move every env on this CPU's lower
+// queues back to its base priority. Costs O(queued envs).
+static void
+sched_boost_all(void)
+{
+	struct RunQueue *rq = &thiscpu->cpu_runq;
+	struct Env *e, *next;
+	int p;
+
+	for (p = 1; p < NENVPRIO; p++) {
+		for (e = rq->rq_head[p]; e; e = next) {
+			next = e->env_rq_next;
+			if (e->env_prio != e->env_base_prio) {
+				runq_remove(e);
+				e->env_prio = e->env_base_prio;
+				e->env_slice = 0;
+				runq_push(thiscpu, e);
+			}
+		}
+	}
+	if (curenv) {
+		curenv->env_prio = curenv->env_base_prio;
+		curenv->env_slice = 0;
+	}
+}
+
+// Charge the TSC cycles since the last call on this CPU to curenv, or
+// to this CPU's idle time if no env is running. Called whenever this
+// CPU switches or resumes an env, and when it halts.
+void
+sched_account(void)
+{
+	uint64_t now = read_tsc();
+	uint64_t delta = now - thiscpu->cpu_acct_tsc;
+
+	if (thiscpu->cpu_acct_tsc == 0) {
+		delta = 0;
+	}
+	thiscpu->cpu_acct_tsc = now;
+	if (curenv) {
+		curenv->env_stats.es_cycles += delta;
+		thiscpu->cpu_stats.es_cycles += delta;
+	} else {
+		thiscpu->cpu_stats.es_idle_cycles += delta;
+	}
+}
+
+// Called on every timer interrupt on this CPU. Charges the tick to the
+// current env, demoting it if it used up its slice, and preempts it if
+// its slice is over or higher-priority work is waiting. Otherwise
+// returns, and trap() resumes the current env.
+void
+sched_tick(void)
+{
+	struct RunQueue *rq = &thiscpu->cpu_runq;
+	struct Env *e = curenv;
+
+	if (++rq->rq_ticks % SCHED_BOOST_TICKS == 0) {
+		sched_boost_all();
+	}
+
+	// Chip away at dead envs' address spaces.
+	env_reclaim(ENV_RECLAIM_TICK);
+
+	if (e == NULL || e->env_status != ENV_RUNNING) {
+		return;
+	}
+
+	// Its affinity no longer includes us; move it.
+	if (!cpu_allowed(e, thiscpu)) {
+		sched_yield();
+	}
+
+	if (++e->env_slice >= SCHED_QUANTUM(e->env_prio)) {
+		// Used its whole slice: CPU-bound, so demote it.
+		if (e->env_prio < ENV_PRIO_LOW) {
+			e->env_prio++;
+		}
+		e->env_slice = 0;
+		sched_yield();
+	}
+
+	if (runq_best(rq) < e->env_prio) {
+		sched_yield();
+	}
+}
+
+// Steal a runnable env from the busiest other CPU.
+// Returns NULL if no other CPU has an env queued that may run here.
+//
+// The thief takes the highest-priority env queued on the victim that
+// may run here, starting from the tail of each level, the opposite end
+// from where the owner dequeues. Choosing the victim only looks at NCPU
+// queue lengths; envs pinned to the victim are skipped over. If all of
+// the victim's envs are pinned away from this CPU, the next busiest CPU
+// is tried, and so on.
+static struct Env *
+sched_steal(void)
+{
+	struct CpuInfo *c, *victim;
+	struct Env *e;
+	uint32_t tried = 0;	// Bit i set: CPU i had nothing for us
+	int p;
+
+	for (;;) {
+		victim = NULL;
+		for (c = cpus; c < cpus + ncpu; c++) {
+			if (c == thiscpu || c->cpu_runq.rq_len == 0 ||
+				((tried >> (c - cpus)) & 1)) {
+				continue;
+			}
+			if (victim == NULL ||
+				c->cpu_runq.rq_len > victim->cpu_runq.rq_len) {
+				victim = c;
+			}
+		}
+		if (victim == NULL) {
+			return NULL;
+		}
+
+		for (p = 0; p < NENVPRIO; p++) {
+			for (e = victim->cpu_runq.rq_tail[p]; e; e = e->env_rq_prev) {
+				if (cpu_allowed(e, thiscpu)) {
+					return e;
+				}
+			}
+		}
+		tried |= 1 << (victim - cpus);
+	}
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	// Implement simple round-robin scheduling.
+	// Priority round-robin over this CPU's run queues.
 	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running, Switch to the first such environment found.
+	// Run the env at the head of this CPU's best non-empty queue;
+	// env_run() puts the previously running env (if it is still
+	// ENV_RUNNING) at the tail of its own level, so envs of equal
+	// priority take turns. If our queues are empty, steal work from
+	// another CPU.
 	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	int i, start;
-	i = curenv == NULL ? 0 : (ENVX(curenv->env_id) + 1) % NENV;
-	start = curenv == NULL ? NENV - 1 : ENVX(curenv->env_id);
+	// If the environment previously running on this CPU is still
+	// ENV_RUNNING and has strictly better priority than anything
+	// queued, or nothing else is runnable, keep running it.
+	struct Env *e;
+	int p;
+
+	// If curenv's affinity no longer includes this CPU, queue it
+	// where it may run.
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+		!cpu_allowed(curenv, thiscpu)) {
+		env_set_status(curenv, ENV_RUNNABLE);
+	}
 
-	for (; i != start; i = (i + 1) % NENV) {
-		if (envs[i].env_status == ENV_RUNNABLE) {
-			env_run(&envs[i]);
+	p = runq_best(&thiscpu->cpu_runq);
+	if (p < NENVPRIO) {
+		e = thiscpu->cpu_runq.rq_head[p];
+		if (curenv && curenv->env_status == ENV_RUNNING &&
+			curenv->env_prio < p) {
+			env_run(curenv);
 		}
+		env_run(e);
+	}
+
+	if ((e = sched_steal()) != NULL) {
+		env_run(e);
+	}
+
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		env_run(curenv);
+	}
+
+	// sched_halt never returns
+	sched_halt();
+}
+
+// Switch this CPU straight to e, which must be ENV_RUNNABLE, as in an
+// IPC handoff. e takes over what is left of curenv's time slice, so a
+// client and server that hand the CPU back and forth cannot use more
+// than one env's share between them. If e may not run on this CPU,
+// just reschedule; e is already queued where it can run.
+void
+sched_handoff(struct Env *e)
+{
+	int quantum = SCHED_QUANTUM(e->env_prio);
+
+	assert(e->env_status == ENV_RUNNABLE);
+	if (!cpu_allowed(e, thiscpu)) {
+		sched_yield();
 	}
+	if (curenv) {
+		e->env_slice = MIN(curenv->env_slice, quantum - 1);
+	}
+	env_run(e);
+}
 
-	if (envs[start].env_status == ENV_RUNNABLE || envs[start].env_status == ENV_RUNNING) {
-		env_run(&envs[start]);
+// Halt this CPU when there is nothing to do. Wait until an interrupt
+// (a wakeup IPI from another CPU, or the boot CPU's timer) wakes it up.
+// This function never returns.
+//
+void
+sched_halt(void)
+{
+	// For debugging and testing purposes, if there are no environments
+	// left in the system, then drop into the kernel monitor. Otherwise
+	// park this CPU: blocked envs may still be woken by other CPUs or
+	// by interrupts.
+	if (env_nlive == 0) {
+		cprintf("No runnable environments in the system!\n");
+		while (1) {
+			monitor(NULL);
+		}
 	}
-	monitor(NULL);
+
+	// Mark that no environment is running on this CPU
+	sched_account();
+	curenv = NULL;
+	pgdir_load(kern_pgdir);
+
+	// Mark that this CPU is in the HALT state, so that when
+	// interrupts come in, we know we should re-acquire the
+	// big kernel lock
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+
+	// Stop the timer, or on the last awake CPU, arm it for the next
+	// deadline only.
+	time_idle();
+
+	// Release the big kernel lock as if we were "leaving" the kernel
+	unlock_kernel();
+
+	// Use the idle time to tear down dead envs' address spaces, then to
+	// zero pages for page_alloc(ALLOC_ZERO).
+	env_reclaim_idle();
+	page_zero_idle();
+
+	// Reset stack pointer, enable interrupts and then halt.
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"sti\n"
+		"1:\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: woke up");  /* mostly to placate the compiler */
 }
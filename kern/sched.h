@@ -1,7 +1,17 @@
 #ifndef YUOS_KERN_SHCED_H
 #define YUOS_KERN_SHCED_H
 
+#include <inc/env.h>
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_handoff(struct Env *e) __attribute__((noreturn));
+
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_tick(void);
+void sched_account(void);
+void sched_boost(struct Env *e);
+void sched_set_priority(struct Env *e, int prio);
 
 #endif /* !YUOS_KERN_SHCED_H */
\ No newline at end of file
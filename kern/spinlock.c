@@ -0,0 +1,161 @@
+// Mutual exclusion spin locks.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kdebug.h>
+
+// The big kernel lock
+struct spinlock kernel_lock = {
+	.name = "kernel_lock"
+};
+
+// Every lock passed to __spin_initlock, for spin_dump_stats
+#define NLOCKS		16
+static struct spinlock *locks[NLOCKS];
+static int nlocks;
+
+// Check whether this CPU is holding the lock.
+bool
+spin_holding(struct spinlock *lk)
+{
+	return lk->next != lk->owner && lk->cpu == thiscpu;
+}
+
+#ifdef DEBUG_SPINLOCK
+// Record the current call stack in pcs[] by following the %ebp chain.
+static void
+get_caller_pcs(uint32_t pcs[])
+{
+	uint32_t *ebp;
+	int i;
+
+	ebp = (uint32_t *)read_ebp();
+	for (i = 0; i < 10; i++) {
+		if (ebp == 0 || ebp < (uint32_t *)ULIM) {
+			break;
+		}
+		pcs[i] = ebp[1];			// saved %eip
+		ebp = (uint32_t *)ebp[0];	// saved %ebp
+	}
+	for (; i < 10; i++) {
+		pcs[i] = 0;
+	}
+}
+#endif
+
+void
+__spin_initlock(struct spinlock *lk, char *name)
+{
+	int i;
+
+	lk->next = lk->owner = 0;
+	lk->name = name;
+	lk->cpu = 0;
+	lk->nacquire = lk->ncontended = 0;
+	lk->spin_cycles = 0;
+
+	for (i = 0; i < nlocks; i++) {
+		if (locks[i] == lk) {
+			return;
+		}
+	}
+	if (nlocks < NLOCKS) {
+		locks[nlocks++] = lk;
+	}
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+// Holding a lock for a long time may cause
+// other CPUs to waste time spinning to acquire it.
+void
+spin_lock(struct spinlock *lk)
+{
+	uint32_t ticket;
+	uint64_t t0;
+
+#ifdef DEBUG_SPINLOCK
+	if (spin_holding(lk)) {
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+	}
+#endif
+
+	// The xadd is atomic and serializes, so that reads after acquire
+	// are not reordered before it.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+		t0 = read_tsc();
+		while (lk->owner != ticket) {
+			asm volatile ("pause");
+		}
+		lk->ncontended++;
+		lk->spin_cycles += read_tsc() - t0;
+	}
+	lk->nacquire++;
+	lk->cpu = thiscpu;
+
+	// Record info about lock acquisition for debugging.
+#ifdef DEBUG_SPINLOCK
+	get_caller_pcs(lk->pcs);
+#endif
+}
+
+// Release the lock.
+void
+spin_unlock(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (!spin_holding(lk)) {
+		int i;
+		uint32_t pcs[10];
+		// Nab the acquiring EIP chain before it gets released
+		memmove(pcs, lk->pcs, sizeof pcs);
+		cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:",
+			cpunum(), lk->name, lk->cpu->cpu_id);
+		for (i = 0; i < 10 && pcs[i]; i++) {
+			struct Eipdebuginfo info;
+			if (debuginfo_eip(pcs[i], &info) >= 0) {
+				cprintf("  %08x %s:%d: %.*s+%x\n", pcs[i],
+					info.eip_file, info.eip_line,
+					info.eip_fn_namelen, info.eip_fn_name,
+					pcs[i] - info.eip_fn_addr);
+			} else {
+				cprintf("  %08x\n", pcs[i]);
+			}
+		}
+		panic("spin_unlock");
+	}
+
+	lk->pcs[0] = 0;
+#endif
+	lk->cpu = 0;
+
+	// Serve the next ticket. Only the holder writes owner, so this
+	// does not need to be atomic, but the locked add keeps reads and
+	// writes in the critical section from being moved after it.
+	xadd(&lk->owner, 1);
+}
+
+// Print the acquire and contention counters of every lock.
+void
+spin_dump_stats(void)
+{
+	struct spinlock *lk;
+	int i;
+
+	cprintf("lock            acquires  contended  spin cycles\n");
+	for (i = -1; i < nlocks; i++) {
+		lk = i < 0 ? &kernel_lock : locks[i];
+		if (i >= 0 && lk == &kernel_lock) {
+			continue;
+		}
+		cprintf("%-14s %9u %10u %12llu\n", lk->name, lk->nacquire,
+			lk->ncontended, lk->spin_cycles);
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef YUOS_KERN_SPINLOCK_H
+#define YUOS_KERN_SPINLOCK_H
+
+#include <inc/types.h>
+
+// Comment this to disable spinlock debugging
+#define DEBUG_SPINLOCK
+
+// Mutual exclusion lock.
+//
+// A ticket lock: each CPU that wants the lock takes the next ticket, and
+// the lock is served in ticket order, so waiters get it first come,
+// first served, and no CPU can be starved by the others.
+struct spinlock {
+	volatile uint32_t next;		// Next ticket to hand out
+	volatile uint32_t owner;	// Ticket now holding the lock
+	char *name;					// Name of lock.
+	struct CpuInfo *cpu;		// The CPU holding the lock.
+
+	// Contention statistics, updated while holding the lock
+	uint32_t nacquire;			// Times acquired
+	uint32_t ncontended;		// Times a CPU had to wait for it
+	uint64_t spin_cycles;		// TSC cycles spent waiting
+
+#ifdef DEBUG_SPINLOCK
+	// For debugging:
+	uintptr_t pcs[10];		// The call stack (an array of program counters)
+							// that locked the lock.
+#endif
+};
+
+void __spin_initlock(struct spinlock *lk, char *name);
+void spin_lock(struct spinlock *lk);
+void spin_unlock(struct spinlock *lk);
+bool spin_holding(struct spinlock *lk);
+void spin_dump_stats(void);
+
+#define spin_initlock(lock)	__spin_initlock(lock, #lock)
+
+// The big kernel lock serializes every CPU that is executing kernel code
+// that is not covered by a finer-grained lock. It is taken on entry from
+// user mode (trap), except for the system calls that syscall_unlocked
+// allows, by the boot CPU before it starts the APs, and by each AP in
+// mp_main, and released just before returning to user mode in env_run or
+// parking the CPU in sched_halt.
+//
+// Lock order: kernel_lock, then env_lock or page_lock, then time_lock,
+// then console_lock. kmem_lock is only ever held on its own, or before
+// console_lock.
+extern struct spinlock kernel_lock;
+
+static inline void
+lock_kernel(void)
+{
+	spin_lock(&kernel_lock);
+}
+
+static inline void
+unlock_kernel(void)
+{
+	spin_unlock(&kernel_lock);
+
+	// Normally we wouldn't need to do this, but QEMU only runs
+	// one CPU at a time and has a long time-slice. Without the
+	// pause, this CPU is likely to reacquire the lock before
+	// another CPU has even been given a chance to acquire it.
+	asm volatile("pause");
+}
+
+#endif /* !YUOS_KERN_SPINLOCK_H */
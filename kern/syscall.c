@@ -10,21 +10,37 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/kmalloc.h>
 #include <kern/e1000.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
-// Destroys the environment on memory errors.
-static void
+// Returns 0, or -E_FAULT if the string is not readable; what came
+// before the bad address has been printed then.
+static int
 sys_cputs(const char *s, size_t len)
 {
-	// Check that the user has permission to read memory [s, s+len).
-	// Destroy the environment if not.
-
-	user_mem_assert(curenv, (const void*)s, len, PTE_P | PTE_U);
-
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	char buf[128];
+	size_t n, i;
+	bool locked;
+	int r = 0;
+
+	// Copy the string in a piece at a time, holding the console so that
+	// the pieces come out together. cprintf would take the console
+	// again, so write the characters out directly.
+	locked = lock_console();
+	for (; len > 0; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		if ((r = copyin(buf, s, n)) < 0) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			cons_putc(buf[i]);
+		}
+	}
+	unlock_console(locked);
+	return r;
 }
 
 // Read a character from the system console without blocking.
@@ -87,9 +103,11 @@ sys_exofork(void)
 
 	e->env_tf = curenv->env_tf;
 
-	e->env_status = ENV_NOT_RUNNABLE;
+	env_set_status(e, ENV_NOT_RUNNABLE);
 
 	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	sched_set_priority(e, curenv->env_base_prio);
+	e->env_affinity = curenv->env_affinity;
 
 
 	curenv->env_tf.tf_regs.reg_eax = e->env_id;
@@ -98,13 +116,67 @@ sys_exofork(void)
 	return curenv->env_tf.tf_regs.reg_eax;
 }
 
+// Fork the current environment. The child gets a copy-on-write copy of
+// our address space (see pgdir_copy_cow), a fresh user exception stack if
+// we have one, and our registers, tweaked so that sys_fork returns 0 in
+// the child. Unlike sys_exofork, the child is left runnable.
+//
+// Returns envid of new environment, or < 0 on error. Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	envid_t envid;
+	int r;
+
+	if ((envid = sys_exofork()) < 0) {
+		return envid;
+	}
+	if ((r = envid2env(envid, &e, 0)) < 0) {
+		return r;
+	}
+
+	if ((r = pgdir_copy_cow(e->env_pgdir, curenv->env_pgdir)) < 0) {
+		goto fail;
+	}
+	if (page_lookup(curenv->env_pgdir, (void *) (UXSTACKTOP - PGSIZE), NULL)) {
+		if (!(pp = page_alloc(ALLOC_ZERO))) {
+			r = -E_NO_MEM;
+			goto fail;
+		}
+		r = page_insert(e->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE),
+			PTE_P | PTE_U | PTE_W);
+		if (r < 0) {
+			page_free(pp);
+			goto fail;
+		}
+	}
+
+	env_set_status(e, ENV_RUNNABLE);
+	return envid;
+
+fail:
+	env_destroy(e);
+	return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
+// Setting a running env ENV_RUNNABLE does nothing. An env may stop
+// itself, and gives up the CPU at once, but not one that is running on
+// another CPU: that env would carry on running there, and once set
+// runnable again, it could be queued and run on a second CPU.
+//
 // Returns 0 on success, < 0 on error. Error are:
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if status is not a valid status for an environment.
+//	-E_INVAL if status is not a valid status for an environment,
+//		or envid is running on another CPU and status is
+//		ENV_NOT_RUNNABLE.
 static int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -125,7 +197,22 @@ sys_env_set_status(envid_t envid, int status)
 		return r;
 	}
 
-	e->env_status = status;
+	if (e->env_status == ENV_RUNNING) {
+		// An env that is running on some CPU is already as runnable
+		// as it gets; queueing it would let a second CPU run it
+		// concurrently.
+		if (status == ENV_RUNNABLE) {
+			return 0;
+		}
+		if (e != curenv) {
+			return -E_INVAL;
+		}
+		env_set_status(e, ENV_NOT_RUNNABLE);
+		e->env_tf.tf_regs.reg_eax = 0;
+		sched_yield();
+	}
+
+	env_set_status(e, status);
 
 	return 0;
 }
@@ -137,19 +224,22 @@ sys_env_set_status(envid_t envid, int status)
 // Returns 0 on success, < 0 on error. Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_FAULT if tf is not readable.
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
-	// Remember to check whether the user has supplied us with a good
-	// address!
 	int r;
 	struct Env *e;
+	struct Trapframe ktf;
 
 	if ((r = envid2env(envid, &e, 1)) != 0) {
 		return r;
 	}
+	if ((r = copyin(&ktf, tf, sizeof(ktf))) < 0) {
+		return r;
+	}
 
-	e->env_tf = *tf;
+	e->env_tf = ktf;
 
 	return 0;
 }
@@ -212,6 +302,103 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return r;
 }
 
+// Allocate 4MB of zeroed, physically contiguous memory and map it at 'va'
+// in the address space of 'envid' as a single large page, replacing
+// anything mapped in [va, va+PTSIZE). perm is as for sys_page_alloc.
+// The mapping can be shared with sys_page_map between 4MB-aligned
+// addresses; unmapping any page in it unmaps all of it.
+//
+// Return 0 on success, < 0 on error. Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not 4MB-aligned.
+//	-E_INVAL if perm is inappropriate.
+//	-E_NOT_SUPP if the CPU does not support 4MB pages.
+//	-E_NO_MEM if there are no 4MB of free contiguous memory.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	int r;
+	struct Env *e;
+	struct PageInfo *page;
+
+	if ((uint32_t)va >= UTOP || (uint32_t)va % PTSIZE != 0) {
+		return -E_INVAL;
+	}
+	if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) {
+		return -E_INVAL;
+	}
+	if (perm & ~(PTE_P | PTE_U | PTE_W | PTE_AVAIL)) {
+		return -E_INVAL;
+	}
+	if (!page_pse) {
+		return -E_NOT_SUPP;
+	}
+
+	r = envid2env(envid, &e, 0);
+	if (r != 0) {
+		return r;
+	}
+
+	page = page_alloc_order(PAGE_PSE_ORDER, ALLOC_ZERO);
+	if (page == NULL) {
+		return -E_NO_MEM;
+	}
+
+	r = page_insert_large(e->env_pgdir, page, va, perm);
+
+	if (r != 0) {
+		page_free_order(page, PAGE_PSE_ORDER);
+	}
+
+	return r;
+}
+
+// Reserve [va, va+len) in the address space of 'envid' as demand-zero
+// memory: every page maps the kernel's shared zero page, and a page of
+// its own is only allocated when the environment first writes to it.
+// Anything mapped in the range before is unmapped. len is rounded up to
+// a whole number of pages. perm is as for sys_page_alloc, except that
+// PTE_SHARE is not allowed: the pages only become private on the write.
+//
+// Return 0 on success, < 0 on error. Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, or the range reaches past UTOP.
+//	-E_INVAL if perm is inappropriate.
+//	-E_NO_MEM if a page table couldn't be allocated. The pages before
+//		the failing one are left mapped.
+static int
+sys_page_zero(envid_t envid, void *va, size_t len, int perm)
+{
+	int r = 0;
+	struct Env *e;
+	uintptr_t a, end;
+
+	end = ROUNDUP((uintptr_t) va + len, PGSIZE);
+	if ((uint32_t)va % PGSIZE != 0 || end > UTOP || end < (uintptr_t) va) {
+		return -E_INVAL;
+	}
+	if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) {
+		return -E_INVAL;
+	}
+	if ((perm & ~(PTE_P | PTE_U | PTE_W | PTE_AVAIL)) || (perm & PTE_SHARE)) {
+		return -E_INVAL;
+	}
+
+	r = envid2env(envid, &e, 0);
+	if (r != 0) {
+		return r;
+	}
+
+	tlb_batch_begin();
+	for (a = (uintptr_t) va; a < end && r == 0; a += PGSIZE) {
+		r = page_map_zero(e->env_pgdir, (void *) a, perm & ~PTE_COW);
+	}
+	tlb_batch_end();
+	return r;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restriction as in sys_page_alloc, except
@@ -227,6 +414,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc)
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is in a 4MB page and srcva or dstva is not
+//		4MB-aligned; the whole large page is mapped at dstva.
 //	-E_NO_MEM if there's no memory to allocate any necessay page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -272,11 +461,69 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 	}
 
+	if (*pte & PTE_PS) {
+		if ((uint32_t)srcva % PTSIZE != 0 || (uint32_t)dstva % PTSIZE != 0) {
+			return -E_INVAL;
+		}
+		return page_insert_large(dste->env_pgdir, page, dstva, perm);
+	}
+
 	r = page_insert(dste->env_pgdir, page, dstva, perm);
 
 	return r;
 }
 
+// Apply n sys_page_map calls, described by ops[0..n), in order, in a
+// single kernel entry. If results is not NULL, results[i] receives the
+// return value of the i'th mapping; it must not be in a page that the
+// batch makes read-only. A failed mapping does not stop the ones after it.
+//
+// Returns the number of mappings that failed, or < 0 on error:
+//	-E_INVAL if n > PAGE_MAP_BATCH_MAX.
+//	-E_NO_MEM if there's no memory to copy the batch in.
+static int
+sys_page_map_batch(const struct PageMapOp *uops, unsigned n, int *uresults)
+{
+	struct PageMapOp *ops;
+	int results[PAGE_MAP_BATCH_MAX];
+	int nfail = 0, r;
+	unsigned i;
+
+	if (n > PAGE_MAP_BATCH_MAX) {
+		return -E_INVAL;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	// Copy the batch in first, since its own mappings may change what
+	// is mapped at uops (fork marks its own pages copy-on-write).
+	if (!(ops = kmalloc(n * sizeof(*ops)))) {
+		return -E_NO_MEM;
+	}
+	if ((r = copyin(ops, uops, n * sizeof(*ops))) < 0) {
+		kfree(ops);
+		return r;
+	}
+
+	// Mappings replaced in the same address space share one shootdown.
+	tlb_batch_begin();
+	for (i = 0; i < n; i++) {
+		results[i] = sys_page_map(ops[i].pm_srcenv, ops[i].pm_srcva,
+			ops[i].pm_dstenv, ops[i].pm_dstva, ops[i].pm_perm);
+		if (results[i] < 0) {
+			nfail++;
+		}
+	}
+	tlb_batch_end();
+	kfree(ops);
+
+	if (uresults && (r = copyout(uresults, results, n * sizeof(*uresults))) < 0) {
+		return r;
+	}
+	return nfail;
+}
+
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
 //
@@ -335,6 +582,32 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
+// A message sent to an env that was not receiving it, queued until the
+// env receives it. See sys_ipc_send.
+struct IpcMsg {
+	struct IpcMsg *im_next;
+	struct Env *im_sender;		// Waiting on us, if its env_ipc_pending
+	envid_t im_from;
+	uint32_t im_value;
+	struct PageInfo *im_page;	// Page sent, which we hold a reference to
+	void *im_srcva;				// Where the sender had it; UTOP if moved
+	int im_perm;
+	bool im_call;				// Sent by sys_ipc_call
+};
+
+// Most messages queued for one env; further senders block
+#define IPC_QUEUE_MAX	8
+
+static int ipc_deliver(struct Env *e, uint32_t value, void *srcva,
+		       size_t len, unsigned perm);
+static void ipc_handoff(struct Env *e);
+static int sys_ipc_send_region(envid_t envid, uint32_t value, void *srcva,
+			       size_t len, unsigned perm);
+static int sys_ipc_recv_region(void *dstva, size_t len, unsigned int timeout);
+static int ipc_enqueue(struct Env *e, uint32_t value, void *srcva,
+		       unsigned perm, bool call);
+static int ipc_dequeue(struct Env *e);
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -373,57 +646,546 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //		address space.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return sys_ipc_send_region(envid, value, srcva, PGSIZE, perm);
+}
+
+// Like sys_ipc_try_send, but send the 'len' bytes of pages at 'srcva'
+// (rounded up to whole pages), all with 'perm', in one message. The
+// receiver gets as many of them as fit in the window it gave
+// sys_ipc_recv_region, mapped from the start of the window, and finds
+// the number of bytes mapped in env_ipc_len.
+//
+// If perm includes IPC_MOVE, the pages the receiver gets are unmapped
+// from the sender, so the region changes hands rather than being shared.
+//
+// Errors are those of sys_ipc_try_send, applied to every page of the
+// region, and
+//	-E_INVAL if srcva < UTOP but len is 0 or the region reaches
+//		past UTOP.
+//	-E_INVAL if the part of the receiver's window that would be
+//		mapped lies over a 4MB page.
+static int
+sys_ipc_send_region(envid_t envid, uint32_t value, void *srcva, size_t len,
+		    unsigned perm)
 {
 	int r;
 	struct Env *e;
-	struct PageInfo *page;
-	pte_t *pte;
 
 	r = envid2env(envid, &e, 0);
 	if (r != 0) {
 		return r;
 	}
 
+	r = ipc_deliver(e, value, srcva, len, perm);
+	if (r != 0) {
+		return r;
+	}
+
+	ipc_handoff(e);
+	return 0;
+}
+
+// Direct handoff: if e, which has just been sent a message, matters at
+// least as much as we do, switch to it now rather than leave it waiting
+// in its run queue. We go to the tail of ours, with the send's result.
+static void
+ipc_handoff(struct Env *e)
+{
+	if (e->env_prio <= curenv->env_prio) {
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_handoff(e);
+	}
+}
+
+// Return whether perm is fit to send pages with (see sys_page_alloc).
+static bool
+ipc_perm_ok(unsigned perm)
+{
+	if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) {
+		return 0;
+	}
+	return (perm & ~(PTE_P | PTE_U | PTE_W | PTE_AVAIL)) == 0;
+}
+
+// Return the page curenv has mapped at the page-aligned va, if it may
+// send it with perm, or else NULL.
+static struct PageInfo *
+ipc_page_lookup(void *va, unsigned perm)
+{
+	struct PageInfo *page;
+	pte_t *pte;
+
+	page = page_lookup(curenv->env_pgdir, va, &pte);
+	if (page == NULL) {
+		return NULL;
+	}
+	// 4MB pages are shared with sys_page_map, not sent.
+	if (*pte & PTE_PS) {
+		return NULL;
+	}
+	if ((*pte & PTE_W) == 0 && perm & PTE_W) {
+		return NULL;
+	}
+	return page;
+}
+
+// A caller that waits for a reply sets env_ipc_waitfrom to the callee,
+// and goes on the callee's env_ipc_callers list, so that ipc_env_free
+// can find it without a scan of envs[]. The list is protected by the
+// big kernel lock.
+
+// Let s accept a message from anyone again.
+static void
+ipc_wait_clear(struct Env *s)
+{
+	struct Env *e;
+
+	if (!s->env_ipc_waitfrom) {
+		return;
+	}
+	e = &envs[ENVX(s->env_ipc_waitfrom)];
+	if (s->env_ipc_caller_prev) {
+		s->env_ipc_caller_prev->env_ipc_caller_next = s->env_ipc_caller_next;
+	} else {
+		e->env_ipc_callers = s->env_ipc_caller_next;
+	}
+	if (s->env_ipc_caller_next) {
+		s->env_ipc_caller_next->env_ipc_caller_prev = s->env_ipc_caller_prev;
+	}
+	s->env_ipc_caller_next = s->env_ipc_caller_prev = NULL;
+	s->env_ipc_waitfrom = 0;
+}
+
+// Make s wait for a message from e, and no one else.
+static void
+ipc_wait_set(struct Env *s, struct Env *e)
+{
+	ipc_wait_clear(s);
+	s->env_ipc_waitfrom = e->env_id;
+	s->env_ipc_caller_prev = NULL;
+	s->env_ipc_caller_next = e->env_ipc_callers;
+	if (e->env_ipc_callers) {
+		e->env_ipc_callers->env_ipc_caller_prev = s;
+	}
+	e->env_ipc_callers = s;
+}
+
+// Deliver an IPC from curenv to e, which must be blocked receiving,
+// and make e runnable. See sys_ipc_send_region for the arguments and
+// errors; also fails with -E_IPC_NOT_RECV if e is waiting for a reply
+// from some other env.
+static int
+ipc_deliver(struct Env *e, uint32_t value, void *srcva, size_t len,
+	    unsigned perm)
+{
+	int r;
+	struct PageInfo *page;
+	size_t off, n = 0;
+	bool move = perm & IPC_MOVE;
+
 	if (e->env_ipc_recving == 0) {
 		return -E_IPC_NOT_RECV;
 	}
+	if (e->env_ipc_waitfrom && e->env_ipc_waitfrom != curenv->env_id) {
+		return -E_IPC_NOT_RECV;
+	}
+	e->env_ipc_perm = 0;
+	e->env_ipc_len = 0;
 
 	if ((uint32_t)srcva < UTOP) {
+		perm &= ~IPC_MOVE;
+		len = ROUNDUP(len, PGSIZE);
 		if ((uint32_t)srcva % PGSIZE != 0) {
 			return -E_INVAL;
 		}
-		if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) {
+		if (len == 0 || len > UTOP - (uint32_t)srcva) {
 			return -E_INVAL;
 		}
-		if (perm & ~(PTE_P | PTE_U | PTE_W | PTE_AVAIL)) {
+		if (!ipc_perm_ok(perm)) {
 			return -E_INVAL;
 		}
-
-		page = page_lookup(curenv->env_pgdir, srcva, &pte);
-		if (page == NULL) {
-			return -E_INVAL;
+		if ((uint32_t)(e->env_ipc_dstva) < UTOP) {
+			n = MIN(len, e->env_ipc_dstlen);
 		}
-		if ((*pte & PTE_W) == 0 && perm & PTE_W) {
-			return -E_INVAL;
+
+		// Check the whole region, and make the receiver's page tables,
+		// before mapping anything, so that a failed send changes
+		// nothing either side can see. A window over a 4MB page of the
+		// receiver would need a page table made in the middle of the
+		// mapping, so it is refused.
+		for (off = 0; off < len; off += PGSIZE) {
+			if (!ipc_page_lookup(srcva + off, perm)) {
+				return -E_INVAL;
+			}
+			if (off >= n) {
+				continue;
+			}
+			if (e->env_pgdir[PDX(e->env_ipc_dstva + off)] & PTE_PS) {
+				return -E_INVAL;
+			}
+			if (!pgdir_walk(e->env_pgdir, e->env_ipc_dstva + off, 1)) {
+				return -E_NO_MEM;
+			}
 		}
 
-		if ((uint32_t)(e->env_ipc_dstva) < UTOP) {
-			r = page_insert(e->env_pgdir, page, e->env_ipc_dstva, perm);
+		// With the page tables in place, page_insert cannot fail.
+		tlb_batch_begin();
+		for (off = 0; off < n; off += PGSIZE) {
+			page = page_lookup(curenv->env_pgdir, srcva + off, NULL);
+			r = page_insert(e->env_pgdir, page, e->env_ipc_dstva + off, perm);
 			if (r != 0) {
-				return r;
+				panic("ipc_deliver: page_insert: %e", r);
 			}
+			if (move) {
+				page_remove(curenv->env_pgdir, srcva + off);
+			}
+		}
+		tlb_batch_end();
+		if (n > 0) {
 			e->env_ipc_perm = perm;
+			e->env_ipc_len = n;
 		}
 	}
 
 	e->env_ipc_value = value;
 	e->env_ipc_from = curenv->env_id;
 	e->env_ipc_recving = 0;
-	e->env_status = ENV_RUNNABLE;
+	ipc_wait_clear(e);
+	// If e was waiting for a reply to a call, that wait is over.
+	e->env_ipc_pending = NULL;
+	ENV_STAT_INC(curenv, es_ipc_sends);
+	ENV_STAT_INC(e, es_ipc_recvs);
+	// Envs that block in IPC are interactive; wake them at their
+	// base priority.
+	sched_boost(e);
+	env_set_status(e, ENV_RUNNABLE);
+
+	return 0;
+}
+
+// Send 'value' (and the page at 'srcva' with 'perm') to 'envid', as
+// sys_ipc_try_send does, except that if 'envid' is not receiving, the
+// message is queued in the kernel for it to receive later instead of
+// failing with -E_IPC_NOT_RECV. At most IPC_QUEUE_MAX messages are
+// queued for one env; once that many are, we block until one of them
+// has been received. Messages are received in the order they were sent.
+//
+// A queued page stays mapped in our address space, and the receiver
+// gets the page mapped there when it sent the message; with IPC_MOVE in
+// perm, it is unmapped from ours at once. A writable page that we no
+// longer have writable by the time it is received, say because we have
+// forked, is copied for the receiver instead.
+//
+// Returns 0 once the message has been delivered or queued, < 0 on error.
+// Errors are those of sys_ipc_try_send except -E_IPC_NOT_RECV, and
+//	-E_NO_MEM if there's no memory for the queued message.
+//	-E_BAD_ENV if 'envid' exits while we are blocked.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	int r;
+	struct Env *e;
+
+	r = envid2env(envid, &e, 0);
+	if (r != 0) {
+		return r;
+	}
+
+	r = ipc_deliver(e, value, srcva, PGSIZE, perm);
+	if (r == 0) {
+		ipc_handoff(e);
+		return 0;
+	}
+	if (r != -E_IPC_NOT_RECV) {
+		return r;
+	}
+
+	r = ipc_enqueue(e, value, srcva, perm, 0);
+	if (r <= 0) {
+		return r;
+	}
+
+	// The queue is full; ipc_refill wakes us when it has room.
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+
+	return 0;
+}
+
+static void
+ipc_msg_free(struct IpcMsg *m)
+{
+	if (m->im_page) {
+		page_decref(m->im_page);
+	}
+	kfree(m);
+}
+
+static void
+ipc_append(struct IpcMsg **list, struct IpcMsg *m)
+{
+	while (*list) {
+		list = &(*list)->im_next;
+	}
+	m->im_next = NULL;
+	*list = m;
+}
+
+// Queue a message from curenv for e, which is not receiving it, after
+// checking the page at srcva, if any, as ipc_deliver does. The message
+// holds a reference to the page until it is received. If 'call', curenv
+// will wait for e's reply once the message is in e's queue.
+//
+// Returns 0 if the message is in e's queue, 1 if the queue is full and
+// curenv must block until ipc_refill moves the message in, or < 0 on
+// error: -E_INVAL as for ipc_deliver, or -E_NO_MEM.
+static int
+ipc_enqueue(struct Env *e, uint32_t value, void *srcva, unsigned perm,
+	    bool call)
+{
+	struct IpcMsg *m;
+	struct PageInfo *page = NULL;
+	bool move = perm & IPC_MOVE;
+
+	perm &= ~IPC_MOVE;
+	if ((uint32_t)srcva < UTOP) {
+		if ((uint32_t)srcva % PGSIZE != 0 || !ipc_perm_ok(perm)) {
+			return -E_INVAL;
+		}
+		if (!(page = ipc_page_lookup(srcva, perm))) {
+			return -E_INVAL;
+		}
+	}
+
+	if ((m = kmalloc(sizeof(*m))) == NULL) {
+		return -E_NO_MEM;
+	}
+	m->im_sender = curenv;
+	m->im_from = curenv->env_id;
+	m->im_value = value;
+	m->im_page = page;
+	m->im_srcva = move ? (void *) UTOP : srcva;
+	m->im_perm = page ? perm : 0;
+	m->im_call = call;
+	if (page) {
+		// A moved page leaves the sender now; the message holds it.
+		page->pp_ref++;
+		if (move) {
+			page_remove(curenv->env_pgdir, srcva);
+		}
+	}
+
+	if (e->env_ipc_nqueued < IPC_QUEUE_MAX) {
+		ipc_append(&e->env_ipc_queue, m);
+		e->env_ipc_nqueued++;
+		curenv->env_ipc_pending = call ? m : NULL;
+		ENV_STAT_INC(curenv, es_ipc_sends);
+		return 0;
+	}
+
+	ipc_append(&e->env_ipc_blocked, m);
+	curenv->env_ipc_pending = m;
+	return 1;
+}
+
+// Move the messages of blocked senders into e's queue while it has
+// room, and let each sender go on: a sys_ipc_send returns, and a
+// sys_ipc_call starts waiting for the reply.
+static void
+ipc_refill(struct Env *e)
+{
+	struct IpcMsg *m;
+	struct Env *s;
+
+	while (e->env_ipc_nqueued < IPC_QUEUE_MAX && (m = e->env_ipc_blocked)) {
+		e->env_ipc_blocked = m->im_next;
+		ipc_append(&e->env_ipc_queue, m);
+		e->env_ipc_nqueued++;
+
+		if ((s = m->im_sender) == NULL || s->env_ipc_pending != m) {
+			m->im_sender = NULL;
+			continue;
+		}
+		ENV_STAT_INC(s, es_ipc_sends);
+		if (m->im_call) {
+			s->env_ipc_recving = 1;
+			ipc_wait_set(s, e);
+		} else {
+			m->im_sender = NULL;
+			s->env_ipc_pending = NULL;
+			env_set_status(s, ENV_RUNNABLE);
+		}
+	}
+}
+
+// Return the page to map for the queued message m. A writable page must
+// still be writable where the sender has it: if the sender has forked
+// since, the page is copy-on-write there, and a writable mapping would
+// let the receiver write into the child's copy as well. If that is so,
+// or the sender no longer has the page, the receiver gets a copy of its
+// own, unless the message holds the last reference to the page.
+// Returns NULL if out of memory.
+static struct PageInfo *
+ipc_msg_page(struct IpcMsg *m)
+{
+	struct Env *s = &envs[ENVX(m->im_from)];
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if (!(m->im_perm & PTE_W) || (uint32_t) m->im_srcva >= UTOP ||
+		m->im_page->pp_ref == 1) {
+		return m->im_page;
+	}
+	if (s->env_id == m->im_from && s->env_status != ENV_FREE &&
+		page_lookup(s->env_pgdir, m->im_srcva, &pte) == m->im_page &&
+		(*pte & PTE_W)) {
+		return m->im_page;
+	}
+
+	if ((pp = page_alloc(0)) == NULL) {
+		return NULL;
+	}
+	memcpy(page2kva(pp), page2kva(m->im_page), PGSIZE);
+	return pp;
+}
+
+// Receive into e, which is curenv, the oldest queued message that it
+// accepts, as ipc_deliver would have delivered it. e's env_ipc_dstva,
+// env_ipc_dstlen and env_ipc_waitfrom must be set.
+//
+// Returns 1 if a message was received, 0 if none is queued, or < 0 on
+// error, in which case the message stays queued:
+//	-E_NO_MEM if there's not enough memory to map the message's page.
+static int
+ipc_dequeue(struct Env *e)
+{
+	struct IpcMsg *m, **pm;
+	struct PageInfo *page;
+	struct Env *s;
+	int r;
+
+	for (pm = &e->env_ipc_queue; (m = *pm) != NULL; pm = &m->im_next) {
+		if (!e->env_ipc_waitfrom || m->im_from == e->env_ipc_waitfrom) {
+			break;
+		}
+	}
+	if (m == NULL) {
+		return 0;
+	}
+
+	e->env_ipc_perm = 0;
+	e->env_ipc_len = 0;
+	if (m->im_page && (uint32_t)(e->env_ipc_dstva) < UTOP) {
+		if ((page = ipc_msg_page(m)) == NULL) {
+			return -E_NO_MEM;
+		}
+		r = page_insert(e->env_pgdir, page, e->env_ipc_dstva, m->im_perm);
+		if (r != 0) {
+			if (page != m->im_page) {
+				page_free(page);
+			}
+			return r;
+		}
+		e->env_ipc_perm = m->im_perm;
+		e->env_ipc_len = PGSIZE;
+	}
+
+	*pm = m->im_next;
+	e->env_ipc_nqueued--;
+	e->env_ipc_value = m->im_value;
+	e->env_ipc_from = m->im_from;
+	e->env_ipc_recving = 0;
+	ipc_wait_clear(e);
+	ENV_STAT_INC(e, es_ipc_recvs);
+
+	// A caller goes on waiting, now for the reply.
+	if ((s = m->im_sender) != NULL && s->env_ipc_pending == m) {
+		s->env_ipc_pending = NULL;
+	}
+	ipc_msg_free(m);
+	ipc_refill(e);
+
+	return 1;
+}
 
+// Called when e is freed: drop the messages queued for it. Senders
+// blocked on e's queue, and callers waiting for a reply from e (whether
+// or not e has received their message yet), fail with -E_BAD_ENV. A
+// message that e itself is waiting on stays queued for its receiver.
+void
+ipc_env_free(struct Env *e)
+{
+	struct IpcMsg *m;
+	struct Env *s;
+
+	e->env_ipc_recving = 0;
+	ipc_wait_clear(e);
+	if (e->env_ipc_pending) {
+		e->env_ipc_pending->im_sender = NULL;
+		e->env_ipc_pending = NULL;
+	}
+
+	while ((m = e->env_ipc_blocked) != NULL || (m = e->env_ipc_queue) != NULL) {
+		if (m == e->env_ipc_blocked) {
+			e->env_ipc_blocked = m->im_next;
+		} else {
+			e->env_ipc_queue = m->im_next;
+		}
+		if ((s = m->im_sender) != NULL && s->env_ipc_pending == m) {
+			s->env_ipc_pending = NULL;
+			s->env_ipc_recving = 0;
+			s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			env_set_status(s, ENV_RUNNABLE);
+		}
+		ipc_msg_free(m);
+	}
+	e->env_ipc_nqueued = 0;
+
+	while ((s = e->env_ipc_callers) != NULL) {
+		ipc_wait_clear(s);
+		if (s->env_ipc_recving) {
+			s->env_ipc_pending = NULL;
+			s->env_ipc_recving = 0;
+			s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			env_set_status(s, ENV_RUNNABLE);
+		}
+	}
+}
+
+// Check a receive window of 'len' bytes at 'dstva', which only matters
+// if dstva < UTOP.
+static int
+ipc_window(void *dstva, size_t len)
+{
+	if ((uint32_t) dstva >= UTOP) {
+		return 0;
+	}
+	if ((unsigned)dstva % PGSIZE != 0) {
+		return -E_INVAL;
+	}
+	if (len == 0 || ROUNDUP(len, PGSIZE) > UTOP - (uint32_t) dstva) {
+		return -E_INVAL;
+	}
 	return 0;
 }
 
+// Called when the timer of an env blocked in sys_ipc_recv or
+// sys_sleep_until expires. A receive that times out fails with
+// -E_TIMEOUT; a sleep returns 0, which sys_sleep_until already stored.
+static void
+env_timeout(void *arg)
+{
+	struct Env *e = arg;
+
+	if (e->env_ipc_recving) {
+		e->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	}
+	env_set_status(e, ENV_RUNNABLE);
+}
+
 // Block until a value is ready. Record that we want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark ourself not runnable, and then give up the CPU.
@@ -431,26 +1193,242 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then we are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If 'timeout' is nonzero, give up after 'timeout' milliseconds.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error. Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if no value arrived within 'timeout' milliseconds.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, unsigned int timeout)
 {
-	if ((uint32_t) dstva < UTOP && (unsigned)dstva % PGSIZE != 0) {
-		return -E_INVAL;
+	return sys_ipc_recv_region(dstva, PGSIZE, timeout);
+}
+
+// Like sys_ipc_recv, but if 'dstva' is < UTOP, we are willing to receive
+// up to 'len' bytes of pages (rounded up to whole pages), mapped from
+// 'dstva' on; see sys_ipc_send_region.
+//
+// Errors are those of sys_ipc_recv, and
+//	-E_INVAL if dstva < UTOP but len is 0 or the window reaches
+//		past UTOP.
+static int
+sys_ipc_recv_region(void *dstva, size_t len, unsigned int timeout)
+{
+	int r;
+
+	if ((r = ipc_window(dstva, len)) < 0) {
+		return r;
+	}
+
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstlen = ROUNDUP(len, PGSIZE);
+	ipc_wait_clear(curenv);
+
+	// A message queued for us is received without blocking.
+	if ((r = ipc_dequeue(curenv)) != 0) {
+		return r < 0 ? r : 0;
 	}
 
 	curenv->env_ipc_recving = 1;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	if (timeout) {
+		timer_set(&curenv->env_timer, time_deadline(time_msec() + timeout),
+			env_timeout, curenv);
+	}
+	sched_yield();
+
+	return 0;
+}
+
+// Send 'value' (and the page at 'srcva' with 'perm') to 'envid', as
+// sys_ipc_send does, then wait for the reply, as sys_ipc_recv(dstva)
+// does, in a single system call. Only a message from 'envid' ends the
+// wait. If 'envid' was receiving, instead of leaving it to the
+// scheduler, this CPU switches straight to it, and it runs on the rest
+// of our time slice.
+//
+// Returns 0 once the reply has arrived, < 0 on error, in which case
+// nothing was sent. Errors are those of sys_ipc_send, and
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	int r;
+	bool queued = 0;
+	struct Env *e;
+
+	if ((r = ipc_window(dstva, PGSIZE)) < 0) {
+		return r;
+	}
+
+	r = envid2env(envid, &e, 0);
+	if (r != 0) {
+		return r;
+	}
+
+	r = ipc_deliver(e, value, srcva, PGSIZE, perm);
+	if (r == -E_IPC_NOT_RECV) {
+		r = ipc_enqueue(e, value, srcva, perm, 1);
+		if (r < 0) {
+			return r;
+		}
+		queued = 1;
+	} else if (r != 0) {
+		return r;
+	}
+
 	curenv->env_ipc_dstva = dstva;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_ipc_dstlen = PGSIZE;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
 	curenv->env_tf.tf_regs.reg_eax = 0;
+	if (r == 1) {
+		// e's queue is full; ipc_refill starts the wait for the reply
+		// once it has room for our message.
+		sched_yield();
+	}
+	curenv->env_ipc_recving = 1;
+	ipc_wait_set(curenv, e);
+	if (queued) {
+		sched_yield();
+	}
+	sched_handoff(e);
+
+	return 0;
+}
+
+// Block until time_msec() reaches 'msec'. The env is not runnable, and
+// uses no CPU, while it sleeps.
+//
+// Returns 0, at once if 'msec' has already passed.
+static int
+sys_sleep_until(unsigned int msec)
+{
+	if ((int32_t) (msec - time_msec()) <= 0) {
+		return 0;
+	}
+
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	timer_set(&curenv->env_timer, time_deadline(msec), env_timeout, curenv);
 	sched_yield();
 
 	return 0;
 }
 
+// Set the scheduling priority of 'envid' to 'prio', which must be
+// between ENV_PRIO_HIGH and ENV_PRIO_LOW. Lower values run first.
+// This sets the env's base priority; the scheduler may still demote it
+// while it is CPU-bound and restores it when it blocks and wakes up.
+// No env can give itself or a child a higher priority than its own base
+// priority, or the multilevel feedback queue would be for nothing.
+//
+// Returns 0 on success, < 0 on error. Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is out of range, or higher (lower in value) than
+//		the caller's base priority.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	int r;
+	struct Env *e;
+
+	if (prio < ENV_PRIO_HIGH || prio > ENV_PRIO_LOW) {
+		return -E_INVAL;
+	}
+	if (prio < curenv->env_base_prio) {
+		return -E_INVAL;
+	}
+
+	if ((r = envid2env(envid, &e, 1)) != 0) {
+		return r;
+	}
+
+	sched_set_priority(e, prio);
+
+	return 0;
+}
+
+// Restrict 'envid' to the CPUs whose bits are set in 'mask' (bit i for
+// CPU i). Bits for CPUs that do not exist are ignored. A runnable env is
+// moved to a CPU it is still allowed on right away; a running one moves
+// at its next timer tick.
+//
+// Returns 0 on success, < 0 on error. Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask contains no existing CPU.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	int r;
+	struct Env *e;
+
+	if (ncpu < 32) {
+		mask &= (1U << ncpu) - 1;
+	}
+	if (mask == 0) {
+		return -E_INVAL;
+	}
+
+	r = envid2env(envid, &e, 1);
+	if (r != 0) {
+		return r;
+	}
+
+	e->env_affinity = mask;
+	if (e->env_status == ENV_RUNNABLE) {
+		env_set_status(e, ENV_RUNNABLE);
+	}
+
+	return 0;
+}
+
+// Copy the resource accounting of 'envid' to *st, counting the pages
+// mapped in its address space into st->es_pages. Any env may read the
+// statistics of any other.
+//
+// Returns 0 on success, < 0 on error. Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_FAULT if st is not a writable user address.
+static int
+sys_env_stats(envid_t envid, struct EnvStats *st)
+{
+	int r;
+	struct Env *e;
+	struct EnvStats kst;
+
+	r = envid2env(envid, &e, 0);
+	if (r != 0) {
+		return r;
+	}
+
+	kst = e->env_stats;
+	kst.es_pages = env_npages(e);
+	return copyout(st, &kst, sizeof(kst));
+}
+
+// Copy the resource accounting of CPU 'cpu' (an index into cpus[]) to *st.
+//
+// Returns 0 on success, < 0 on error. Errors are:
+//	-E_INVAL if there is no such CPU.
+//	-E_FAULT if st is not a writable user address.
+static int
+sys_cpu_stats(int cpu, struct EnvStats *st)
+{
+	if (cpu < 0 || cpu >= ncpu) {
+		return -E_INVAL;
+	}
+
+	// Bring the running CPU's own counters up to date.
+	sched_account();
+	return copyout(st, &cpus[cpu].cpu_stats, sizeof(*st));
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -458,18 +1436,38 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Store the nanoseconds elapsed since boot in *nsec.
+//
+// Returns 0 on success, or -E_FAULT if nsec is not a writable user
+// address.
+static int
+sys_time_nsec(uint64_t *nsec)
+{
+	uint64_t now = time_nsec();
+
+	return copyout(nsec, &now, sizeof(now));
+}
+
 // Send packet to e1000 driver
 // return 0 on success
-// Return -1 on error
+// Return -E_FAULT if td or the packet it points to is not readable
 static int
 sys_tx_pkt(struct tx_desc *td)
 {
-	user_mem_assert(curenv, td, sizeof(struct tx_desc), PTE_U);
+	struct tx_desc kt;
+	physaddr_t pa;
+	int r;
 
-	user_mem_phy_addr((uintptr_t)(td->addr), (physaddr_t *)&(td->addr));
+	if ((r = copyin(&kt, td, sizeof(kt))) < 0) {
+		return r;
+	}
+	if ((r = user_mem_phy_addr((uintptr_t)(kt.addr), &pa)) < 0) {
+		return r;
+	}
+	kt.addr = pa;
 
 	while(1) {
-		if (e1000_put_tx_desc(td) == 0) {
+		if (e1000_put_tx_desc(&kt) == 0) {
 			break;
 		}
 	}
@@ -484,22 +1482,56 @@ static int
 sys_rx_pkt(struct rx_desc *rd)
 {
 	int r;
+	struct rx_desc kr;
+	uintptr_t va;
+	physaddr_t pa;
 
-	user_mem_assert(curenv, rd, sizeof(struct rx_desc), PTE_U);
+	if ((r = copyin(&kr, rd, sizeof(kr))) < 0) {
+		return r;
+	}
+	va = kr.addr;
 
-	struct rx_desc kr = *rd;
+	// The receive buffer is swapped with a page of the driver's, which
+	// cannot be done to a piece of a 4MB page, and must be the env's own
+	// writable page: this breaks copy-on-write, and so never hands the
+	// driver the zero page.
+	if (va >= UTOP || (curenv->env_pgdir[PDX(va)] & PTE_PS)) {
+		return -E_INVAL;
+	}
+	user_mem_assert(curenv, ROUNDDOWN((void *) va, PGSIZE), PGSIZE,
+		PTE_U | PTE_W);
 
-	user_mem_phy_addr((uintptr_t)(kr.addr), (physaddr_t*)&(kr.addr));
+	if ((r = user_mem_phy_addr(va, &pa)) < 0) {
+		return r;
+	}
+	kr.addr = pa;
 
 	if ((r = e1000_get_rx_desc(&kr)) != 0) {
 		return r;
 	}
 
-	user_mem_page_replace(rd->addr, pa2page(kr.addr));
-	kr.addr = rd->addr;
-	*rd = kr;
+	user_mem_page_replace(va, pa2page(kr.addr));
+	kr.addr = va;
+	return copyout(rd, &kr, sizeof(kr));
+}
 
-	return 0;
+// Return whether system call 'num' may run without the big kernel lock.
+// These calls only touch curenv, per-CPU state, and data covered by a
+// finer-grained lock (console_lock, time_lock), and never block or
+// switch envs. Nor do they touch user memory: tlb_shootdown does not
+// wait for a CPU that is in the kernel without the big kernel lock, so
+// such a CPU may still see pages that another CPU has unmapped and freed.
+bool
+syscall_unlocked(uint32_t num)
+{
+	switch (num) {
+	case SYS_cgetc:
+	case SYS_getenvid:
+	case SYS_time_msec:
+		return 1;
+	default:
+		return 0;
+	}
 }
 
 // Dispatches to the correct kernel function, passing the arguments.
@@ -509,10 +1541,11 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
 
+	ENV_STAT_INC(curenv, es_syscalls);
+
 	switch (syscallno) {
 	case SYS_cputs:
-		sys_cputs((char *)a1, (size_t)a2);
-		return 0;
+		return sys_cputs((char *)a1, (size_t)a2);
 
 	case SYS_getenvid:
 		return (int32_t)sys_getenvid();
@@ -529,6 +1562,19 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_page_unmap:
 		return sys_page_unmap((envid_t)a1, (void *)a2);
 
+	case SYS_page_alloc_large:
+		return sys_page_alloc_large((envid_t)a1, (void *)a2, (int)a3);
+
+	case SYS_fork:
+		return sys_fork();
+
+	case SYS_page_zero:
+		return sys_page_zero((envid_t)a1, (void *)a2, (size_t)a3, (int)a4);
+
+	case SYS_page_map_batch:
+		return sys_page_map_batch((const struct PageMapOp *)a1, (unsigned)a2,
+			(int *)a3);
+
 	case SYS_yield:
 		sys_yield();
 		return 0;
@@ -546,7 +1592,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return (int32_t)sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void *)a3, (unsigned)a4);
 
 	case SYS_ipc_recv:
-		return (int32_t)sys_ipc_recv((void *)a1);
+		return (int32_t)sys_ipc_recv((void *)a1, (unsigned int)a2);
 
 	case SYS_env_set_trapframe:
 		return (int32_t)sys_env_set_trapframe((envid_t)a1, (struct Trapframe *) a2);
@@ -563,6 +1609,38 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_rx_pkt:
 		return sys_rx_pkt((struct rx_desc *) a1);
 
+	case SYS_env_set_priority:
+		return sys_env_set_priority((envid_t) a1, (int) a2);
+
+	case SYS_time_nsec:
+		return sys_time_nsec((uint64_t *) a1);
+
+	case SYS_sleep_until:
+		return sys_sleep_until((unsigned int) a1);
+
+	case SYS_env_set_affinity:
+		return sys_env_set_affinity((envid_t) a1, a2);
+
+	case SYS_env_stats:
+		return sys_env_stats((envid_t) a1, (struct EnvStats *) a2);
+
+	case SYS_cpu_stats:
+		return sys_cpu_stats((int) a1, (struct EnvStats *) a2);
+
+	case SYS_ipc_call:
+		return sys_ipc_call((envid_t) a1, a2, (void *) a3, (unsigned) a4,
+			(void *) a5);
+
+	case SYS_ipc_send_region:
+		return sys_ipc_send_region((envid_t) a1, a2, (void *) a3, (size_t) a4,
+			(unsigned) a5);
+
+	case SYS_ipc_recv_region:
+		return sys_ipc_recv_region((void *) a1, (size_t) a2, (unsigned int) a3);
+
+	case SYS_ipc_send:
+		return sys_ipc_send((envid_t) a1, a2, (void *) a3, (unsigned) a4);
+
 	default:
 		return -E_NO_SYS;
 	}
@@ -2,7 +2,10 @@
 #define YUOS_KERN_SYSCALL_H
 
 #include <inc/syscall.h>
+#include <inc/env.h>
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+bool syscall_unlocked(uint32_t num);
+void ipc_env_free(struct Env *e);
 
 #endif /* !YUOS_KERN_SYSCALL_H */
\ No newline at end of file
@@ -1,12 +1,84 @@
 #include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/timer.h>
+#include <kern/spinlock.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 static unsigned int ticks;
 
+// High-resolution clock.
+//
+// At boot the TSC and the LAPIC timer are both measured against the PIT,
+// whose input clock has a fixed, known frequency. The LAPIC timer is
+// then programmed for exact 10 ms ticks, and time_nsec() converts TSC
+// cycles since boot to nanoseconds.
+#define CALIBRATE_MS	50		// Length of the calibration window
+static uint64_t tsc_boot;		// TSC at the end of calibration
+static uint32_t tsc_khz;		// TSC cycles per millisecond, 0 if unknown
+static uint64_t last_nsec;		// Largest value time_nsec has returned
+static struct spinlock time_lock;	// Protects last_nsec
+
+// Tickless idle.
+//
+// Only the boot CPU keeps time, so an idle AP can simply stop its timer
+// and sleep until a wakeup IPI arrives. The boot CPU keeps ticking while
+// any other CPU is awake; once it is the last CPU to go idle it switches
+// its timer to one-shot mode, armed for the next deadline, and on wakeup
+// credits the ticks that went by from the LAPIC's current count.
+static bool tickless[NCPU];		// This CPU's timer is not periodic
+static uint32_t idle_count;		// One-shot count the boot CPU armed
+static uint32_t idle_rem;		// Counts short of a whole tick
+
+// Busy-wait CALIBRATE_MS on PIT counter 2 and return the TSC cycles that
+// went by; the LAPIC timer counts down from ~0 over the same window.
+static uint64_t
+calibrate_pit(uint32_t *lapic_counts)
+{
+	uint32_t latch = TIMER_FREQ / (1000 / CALIBRATE_MS);
+	uint64_t t0, t1;
+	uint32_t n;
+
+	// Counter 2 is gated by port B; keep the speaker off.
+	outb(IO_PPI, (inb(IO_PPI) & ~PPI_SPKR) | PPI_GATE2);
+	outb(TIMER_MODE, TIMER_SEL2);
+	outb(TIMER_CNTR2, latch & 0xff);
+	outb(TIMER_CNTR2, latch >> 8);
+
+	lapic_timer_oneshot(~0U);
+	t0 = read_tsc();
+	// OUT2 goes high when the count reaches 0. Don't hang on machines
+	// without a PIT.
+	for (n = 0; !(inb(IO_PPI) & PPI_OUT2); n++) {
+		if (n == 10000000) {
+			*lapic_counts = 0;
+			return 0;
+		}
+	}
+	t1 = read_tsc();
+	*lapic_counts = ~0U - lapic_timer_count();
+	return t1 - t0;
+}
+
 void
 time_init(void)
 {
+	uint64_t cycles;
+	uint32_t counts;
+
 	ticks = 0;
+	spin_initlock(&time_lock);
+
+	cycles = calibrate_pit(&counts);
+	tsc_khz = cycles / CALIBRATE_MS;
+	tsc_boot = read_tsc();
+	if (counts) {
+		lapic_timer_ticr = counts / CALIBRATE_MS * 10;
+	}
+	lapic_timer_periodic();
+	cprintf("time: TSC %u kHz, LAPIC timer %u counts per tick\n",
+		tsc_khz, lapic_timer_ticr);
 }
 
 // This should be called once per time interrupt. A timer interrupt
@@ -18,10 +90,128 @@ time_tick(void)
 	if (ticks * 10 < ticks) {
 		panic("time_tick: time overflowed");
 	}
+	timer_run(ticks);
+}
+
+// Return the timer tick at which the absolute time 'msec' (as returned
+// by time_msec) will have passed, for use with timer_set.
+uint32_t
+time_deadline(unsigned int msec)
+{
+	int32_t left = msec - time_msec();
+
+	if (left <= 0) {
+		return ticks;
+	}
+	return ticks + (left + 9) / 10;
 }
 
 unsigned int
 time_msec(void)
 {
+	if (tsc_khz) {
+		return time_nsec() / 1000000;
+	}
 	return ticks * 10;
 }
+
+// Convert a span of TSC cycles to nanoseconds; 0 if the TSC could not
+// be calibrated.
+uint64_t
+time_cycles_to_nsec(uint64_t cycles)
+{
+	if (!tsc_khz) {
+		return 0;
+	}
+	return cycles / tsc_khz * 1000000 + cycles % tsc_khz * 1000000 / tsc_khz;
+}
+
+// Return nanoseconds since boot. Falls back to tick resolution if the
+// TSC could not be calibrated. The TSCs of different CPUs may be slightly
+// out of step, so never return less than a previous call did. This is
+// called without the kernel lock (see syscall_unlocked).
+uint64_t
+time_nsec(void)
+{
+	uint64_t nsec;
+
+	if (tsc_khz) {
+		nsec = time_cycles_to_nsec(read_tsc() - tsc_boot);
+	} else {
+		nsec = (uint64_t) ticks * 10000000;
+	}
+	spin_lock(&time_lock);
+	if (nsec < last_nsec) {
+		nsec = last_nsec;
+	}
+	last_nsec = nsec;
+	spin_unlock(&time_lock);
+	return nsec;
+}
+
+// Return the number of LAPIC timer counts until the next event that
+// needs the boot CPU's attention, i.e. the next timer wheel deadline.
+static uint32_t
+time_next_deadline(void)
+{
+	uint32_t left = timer_ticks_left();
+
+	if (left >= ~0U / lapic_timer_ticr) {
+		return ~0U;
+	}
+	return left * lapic_timer_ticr;
+}
+
+// Called by sched_halt with the kernel lock held, just before this CPU
+// halts, to stop or slow down its timer.
+void
+time_idle(void)
+{
+	struct CpuInfo *c;
+
+	if (thiscpu != bootcpu) {
+		lapic_timer_oneshot(0);
+		tickless[cpunum()] = 1;
+		return;
+	}
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c != thiscpu && (c->cpu_status != CPU_HALTED || c->cpu_kicked)) {
+			return;
+		}
+	}
+	idle_count = time_next_deadline();
+	if (idle_count < lapic_timer_ticr) {
+		idle_count = lapic_timer_ticr;
+	}
+	lapic_timer_oneshot(idle_count);
+	tickless[cpunum()] = 1;
+}
+
+// Called by trap() with the kernel lock held when a halted CPU wakes up,
+// to bring back its periodic timer.
+void
+time_resume(void)
+{
+	uint32_t left, elapsed;
+
+	if (!tickless[cpunum()]) {
+		return;
+	}
+	tickless[cpunum()] = 0;
+
+	if (thiscpu == bootcpu) {
+		// If the one-shot expired, its interrupt (being handled now or
+		// still pending) will call time_tick for the last tick.
+		left = lapic_timer_count();
+		elapsed = idle_count - left;
+		if (left == 0) {
+			elapsed -= lapic_timer_ticr;
+		}
+		idle_rem += elapsed % lapic_timer_ticr;
+		ticks += elapsed / lapic_timer_ticr + idle_rem / lapic_timer_ticr;
+		idle_rem %= lapic_timer_ticr;
+		timer_run(ticks);
+	}
+	lapic_timer_periodic();
+}
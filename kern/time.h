@@ -1,8 +1,15 @@
 #ifndef YUOS_KERN_TIME_H
 #define YUOS_KERN_TIME_H
 
+#include <inc/types.h>
+
 void time_init(void);
 void time_tick(void);
 unsigned int time_msec(void);
+uint64_t time_nsec(void);
+uint64_t time_cycles_to_nsec(uint64_t cycles);
+uint32_t time_deadline(unsigned int msec);
+void time_idle(void);
+void time_resume(void);
 
 #endif /* YUOS_KENR_TIME_H */
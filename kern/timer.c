@@ -0,0 +1,164 @@
+// Kernel timers.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+
+#include <kern/timer.h>
+
+// Hierarchical timer wheel.
+//
+// Timers are kept on TW_LEVELS wheels of TW_SIZE slots each. Level l
+// holds timers due between TW_SIZE^l and TW_SIZE^(l+1) ticks from now,
+// in the slot picked by bits [TW_BITS*l, TW_BITS*(l+1)) of their expiry
+// tick. Each time the level 0 wheel wraps, the next slot of level 1 is
+// cascaded down into the lower levels, and so on up. Adding and removing
+// a timer is O(1), and each tick does O(1) work plus the timers that
+// fire or cascade.
+//
+// Timers further out than the top wheel can hold are parked in its
+// furthest slot and re-filed when they cascade.
+//
+// The wheel is advanced by time_tick() on the boot CPU. Everything here
+// is protected by the big kernel lock.
+
+#define TW_BITS			6
+#define TW_SIZE			(1 << TW_BITS)
+#define TW_MASK			(TW_SIZE - 1)
+#define TW_LEVELS		4
+
+static struct Timer *wheel[TW_LEVELS][TW_SIZE];
+static uint32_t wheel_now;		// Last tick the wheel has processed
+static int timer_npending;		// Timers on the wheel
+
+// File t in the slot for t->tm_expires. Timers that are already due go in
+// the current level 0 slot, which timer_run is about to scan.
+static void
+wheel_insert(struct Timer *t)
+{
+	int32_t delta = t->tm_expires - wheel_now;
+	uint32_t expires = t->tm_expires;
+	struct Timer **slot;
+	int l;
+
+	if (delta < 0) {
+		delta = 0;
+		expires = wheel_now;
+	}
+	for (l = 0; l < TW_LEVELS - 1; l++) {
+		if ((uint32_t) delta < (1U << (TW_BITS * (l + 1)))) {
+			break;
+		}
+	}
+	if (l == TW_LEVELS - 1 && (uint32_t) delta >= (1U << (TW_BITS * TW_LEVELS))) {
+		expires = wheel_now + (1U << (TW_BITS * TW_LEVELS)) - 1;
+	}
+	slot = &wheel[l][(expires >> (TW_BITS * l)) & TW_MASK];
+
+	t->tm_next = *slot;
+	if (*slot) {
+		(*slot)->tm_pprev = &t->tm_next;
+	}
+	*slot = t;
+	t->tm_pprev = slot;
+}
+
+// Arm t to call func(arg) at timer tick 'expires'. A deadline that has
+// already passed fires on the next tick. Re-arms t if it is pending.
+void
+timer_set(struct Timer *t, uint32_t expires, void (*func)(void *), void *arg)
+{
+	timer_cancel(t);
+	if ((int32_t) (expires - wheel_now) <= 0) {
+		expires = wheel_now + 1;
+	}
+	t->tm_expires = expires;
+	t->tm_func = func;
+	t->tm_arg = arg;
+	wheel_insert(t);
+	timer_npending++;
+}
+
+// Disarm t. Does nothing if t is not pending.
+void
+timer_cancel(struct Timer *t)
+{
+	if (!t->tm_pprev) {
+		return;
+	}
+	*t->tm_pprev = t->tm_next;
+	if (t->tm_next) {
+		t->tm_next->tm_pprev = t->tm_pprev;
+	}
+	t->tm_next = NULL;
+	t->tm_pprev = NULL;
+	timer_npending--;
+}
+
+// Move every timer in wheel[l][idx] to the level its deadline now needs.
+static void
+wheel_cascade(int l, int idx)
+{
+	struct Timer *t, *next;
+
+	t = wheel[l][idx];
+	wheel[l][idx] = NULL;
+	for (; t; t = next) {
+		next = t->tm_next;
+		wheel_insert(t);
+	}
+}
+
+// Advance the wheel to tick 'now', firing every timer that comes due.
+void
+timer_run(uint32_t now)
+{
+	struct Timer *t;
+	int l, idx;
+
+	while ((int32_t) (now - wheel_now) > 0) {
+		wheel_now++;
+		if (timer_npending == 0) {
+			continue;
+		}
+
+		for (l = 1; l < TW_LEVELS; l++) {
+			if (wheel_now & ((1U << (TW_BITS * l)) - 1)) {
+				break;
+			}
+			wheel_cascade(l, (wheel_now >> (TW_BITS * l)) & TW_MASK);
+		}
+
+		idx = wheel_now & TW_MASK;
+		while ((t = wheel[0][idx]) != NULL) {
+			timer_cancel(t);
+			t->tm_func(t->tm_arg);
+		}
+	}
+}
+
+// Return how many ticks from now the wheel next needs to run: the
+// earliest level 0 deadline or higher-level cascade. ~0 if no timers
+// are pending. Scans at most TW_LEVELS * TW_SIZE slots.
+uint32_t
+timer_ticks_left(void)
+{
+	uint32_t best = ~0U, base, delta;
+	int l, i;
+
+	if (timer_npending == 0) {
+		return best;
+	}
+	for (l = 0; l < TW_LEVELS; l++) {
+		base = wheel_now >> (TW_BITS * l);
+		for (i = 1; i <= TW_SIZE; i++) {
+			if (wheel[l][(base + i) & TW_MASK]) {
+				delta = ((base + i) << (TW_BITS * l)) - wheel_now;
+				if (delta < best) {
+					best = delta;
+				}
+				break;
+			}
+		}
+	}
+	return best;
+}
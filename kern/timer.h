@@ -0,0 +1,11 @@
+#ifndef YUOS_KERN_TIMER_H
+#define YUOS_KERN_TIMER_H
+
+#include <inc/env.h>
+
+void timer_set(struct Timer *t, uint32_t expires, void (*func)(void *), void *arg);
+void timer_cancel(struct Timer *t);
+void timer_run(uint32_t now);
+uint32_t timer_ticks_left(void);
+
+#endif /* !YUOS_KERN_TIMER_H */
@@ -11,8 +11,7 @@
 #include <kern/picirq.h>
 #include <kern/console.h>
 #include <kern/time.h>
-
-static struct Taskstate ts;
+#include <kern/spinlock.h>
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapfram and print some
@@ -91,6 +90,8 @@ trap_init(void)
 	extern void trap_simderr();
 	extern void trap_syscall();
 	extern void irq_timer();
+	extern void irq_resched();
+	extern void irq_tlb();
 
 	SETGATE(idt[T_DIVIDE], 	0, GD_KT, trap_divide, 	3);
 	SETGATE(idt[T_DEBUG], 	0, GD_KT, trap_debug, 	3);
@@ -112,28 +113,38 @@ trap_init(void)
 	SETGATE(idt[T_SIMDERR], 0, GD_KT, trap_simderr, 3);
 	SETGATE(idt[T_SYSCALL],	0, GD_KT, trap_syscall, 3);
 	SETGATE(idt[IRQ_OFFSET + IRQ_TIMER], 0, GD_KT, irq_timer, 3);
+	SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, irq_resched, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, irq_tlb, 0);
 
 	// Per-CPU setup
 	trap_init_percpu();
 }
 
 // Initialize and load the per-CPU TSS and IDT
+//
+// Each CPU has its own TSS (thiscpu->cpu_ts) whose esp0 points at the top
+// of that CPU's kernel stack, KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and
+// its own TSS descriptor in the gdt at GD_TSS0 + (i << 3).
 void
 trap_init_percpu(void)
 {
+	int i = cpunum();
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	ts->ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	ts->ts_ss0 = GD_KD;
+	ts->ts_iomb = sizeof(struct Taskstate);
 
 	// Initialize the TSS slot of the gdt.
-	gdt[GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) ts,
 						sizeof(struct Taskstate) - 1, 0);
-	gdt[GD_TSS0 >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
 
 	// Load the TSS selector (like other segment selectors, the
 	// bottom three bits are special; we leave them 0)
-	ltr(GD_TSS0);
+	ltr(GD_TSS0 + (i << 3));
 
 	// Load the IDT
 	lidt(&idt_pd);
@@ -186,6 +197,8 @@ print_regs(struct PushRegs *regs)
 static void
 trap_dispatch(struct Trapframe *tf)
 {
+	bool locked;
+
 	// Handle processor exceptions.
 
 	// Handle system call
@@ -208,21 +221,42 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		// Add time tick increment to clock interrupts.
 		// Be careful! In multiprocessors, clock interrupts are
-		// triggered on every CPU.
-		time_tick();
+		// triggered on every CPU, so only the boot CPU advances time.
+		if (thiscpu == bootcpu) {
+			time_tick();
+		}
 
 		lapic_eoi();
-		sched_yield();
+		sched_tick();
+		return;
+	}
+
+	// Handle wakeup IPIs. The CPU was idle; trap() will call the
+	// scheduler once we return since there is no curenv to resume.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+		lapic_eoi();
+		return;
+	}
+
+	// A TLB shootdown IPI that arrived after this CPU left user mode.
+	// trap() has already carried out the flush.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lapic_eoi();
+		return;
 	}
 
 	// Handle keyboard and serial interrupts.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
+		locked = lock_console();
 		kbd_intr();
+		unlock_console(locked);
 		sched_yield();
 	}
 
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL) {
+		locked = lock_console();
 		serial_intr();
+		unlock_console(locked);
 		sched_yield();
 	}
 
@@ -249,9 +283,61 @@ trap(struct Trapframe *tf)
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
+	// Halt the CPU if some other CPU has called panic()
+	extern const char *panicstr;
+	if (panicstr) {
+		asm volatile("hlt");
+	}
+
+	// Re-acquire the big kernel lock if we were halted in
+	// sched_yield()
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
+		lock_kernel();
+		thiscpu->cpu_kicked = 0;
+		time_resume();
+	}
+
 	if ((tf->tf_cs & 3) == 3) {
 		// Trap from user mode.
+		// From here on, tlb_shootdown no longer waits for this CPU,
+		// so carry out any flush it has posted before we go on.
+		xchg(&thiscpu->cpu_user, 0);
+		tlb_shootdown_poll();
+		if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+			lapic_eoi();
+			env_pop_tf(tf);
+		}
+
+		// System calls that rely only on finer-grained locks run
+		// without the big kernel lock, in parallel with other CPUs,
+		// and return straight to the caller. A zombie takes the
+		// locked path instead, so that an env spinning on these calls
+		// is freed now rather than on its next locked trap. (If
+		// another CPU marks it ENV_DYING just after we look, the next
+		// system call catches it.)
+		if (tf->tf_trapno == T_SYSCALL &&
+			syscall_unlocked(tf->tf_regs.reg_eax) &&
+			curenv->env_status != ENV_DYING) {
+			tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
+				tf->tf_regs.reg_edx, tf->tf_regs.reg_ecx,
+				tf->tf_regs.reg_ebx, tf->tf_regs.reg_edi,
+				tf->tf_regs.reg_esi);
+			env_pop_tf(tf);
+		}
+
+		// Acquire the big kernel lock before doing any
+		// serious kernel work.
+		lock_kernel();
 		assert(curenv);
+		// The BKL holder may have changed our page tables meanwhile.
+		tlb_shootdown_poll();
+
+		// Garbage collect if current environment is a zombie
+		if (curenv->env_status == ENV_DYING) {
+			env_free(curenv);
+			curenv = NULL;
+			sched_yield();
+		}
 
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
@@ -278,6 +364,55 @@ trap(struct Trapframe *tf)
 	}
 }
 
+// Resume the kernel code that tf interrupted.
+static void __attribute__((noreturn))
+trap_resume_kernel(struct Trapframe *tf)
+{
+	__asm __volatile("movl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tiret"
+		: : "g" (tf) : "memory");
+	panic("iret failed");  /* mostly to placate the compiler */
+}
+
+// A page fault in the kernel is a bug, unless copyin or copyout touched
+// a user address: then a write to a copy-on-write page is resolved for
+// curenv, and any other fault makes the copy fail with -E_FAULT.
+static void
+kernel_page_fault(struct Trapframe *tf, uint32_t fault_va)
+{
+	uintptr_t fixup;
+	bool locked;
+	int r;
+
+	if (fault_va >= ULIM || !(fixup = ex_table_fixup(tf->tf_eip))) {
+		print_trapframe(tf);
+		panic("kernel page fault at va %08x", fault_va);
+	}
+
+	if (curenv && fault_va < UTOP &&
+		(tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)) {
+		// System calls that run without the big kernel lock (see
+		// syscall_unlocked) need it to change page tables.
+		if ((locked = !spin_holding(&kernel_lock))) {
+			lock_kernel();
+		}
+		r = page_cow_break(curenv->env_pgdir, (void *) fault_va);
+		if (locked) {
+			unlock_kernel();
+		}
+		if (r == 0) {
+			trap_resume_kernel(tf);
+		}
+	}
+
+	tf->tf_eip = fixup;
+	trap_resume_kernel(tf);
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
@@ -287,6 +422,9 @@ page_fault_handler(struct Trapframe *tf)
 	fault_va = rcr2();
 
 	// Handle kernel-mode page faults.
+	if ((tf->tf_cs & 3) == 0) {
+		kernel_page_fault(tf, fault_va);
+	}
 
 	if (fault_va >= UTOP) {
 		panic("page_fault_handler fault_va >= UTOP, fault_va is 0x%08x", fault_va);
@@ -296,6 +434,13 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exception, so if we get there,
 	// the page fault happened in user mode.
 
+	// A write to a copy-on-write page: make the environment its own copy
+	// right here, without a round trip through its page fault upcall.
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR) &&
+		page_cow_break(curenv->env_pgdir, (void *) fault_va) == 0) {
+		return;
+	}
+
 	// Call the environment's page fault upcall, if one exists. Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -325,6 +470,7 @@ page_fault_handler(struct Trapframe *tf)
 	}
 
 	struct UTrapframe u;
+	uintptr_t esp;
 	u.utf_fault_va = fault_va;
 	u.utf_err = tf->tf_err;
 	u.utf_regs = tf->tf_regs;
@@ -333,14 +479,16 @@ page_fault_handler(struct Trapframe *tf)
 	u.utf_esp = tf->tf_esp;
 
 	if (curenv->env_tf.tf_esp >= UXSTACKTOP - PGSIZE && curenv->env_tf.tf_esp < UXSTACKTOP) {
-		curenv->env_tf.tf_esp -= (sizeof(struct UTrapframe) + 4);
-		user_mem_assert(curenv, (const void*)(curenv->env_tf.tf_esp), sizeof(struct UTrapframe) + 4, PTE_W);
-		*((struct UTrapframe*)(curenv->env_tf.tf_esp)) = u;
+		esp = curenv->env_tf.tf_esp - (sizeof(struct UTrapframe) + 4);
 	} else {
-		curenv->env_tf.tf_esp = UXSTACKTOP - sizeof(struct UTrapframe);
-		*((struct UTrapframe*)(curenv->env_tf.tf_esp)) = u;
+		esp = UXSTACKTOP - sizeof(struct UTrapframe);
+	}
+	if (copyout((void *) esp, &u, sizeof(u)) < 0) {
+		goto fail;
 	}
+	curenv->env_tf.tf_esp = esp;
 	curenv->env_tf.tf_eip = (uintptr_t)(curenv->env_pgfault_upcall);
+	ENV_STAT_INC(curenv, es_pgfaults);
 	env_run(curenv);
 
 fail:
@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW 		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -24,10 +20,19 @@ pgfault(struct UTrapframe *utf)
 	//	Use the read-only page table mappings at uvpt
 	//	(see <inc/memlayout.h>).
 	addr = ROUNDDOWN(addr, PGSIZE);
+	if (uvpd[PDX(addr)] & PTE_PS) {
+		panic("pgfault at %08x in a 4MB page", addr);
+	}
 	if (!(uvpt[(unsigned)addr/PGSIZE] & PTE_P)) {
-		r = sys_page_alloc(0, addr, PTE_W | PTE_U | PTE_P);
+		// A read only needs to see zeros; the kernel gives us a page
+		// of our own if we write to it later.
+		if (err & FEC_WR) {
+			r = sys_page_alloc(0, addr, PTE_W | PTE_U | PTE_P);
+		} else {
+			r = sys_page_zero(0, addr, PGSIZE, PTE_W | PTE_U | PTE_P);
+		}
 		if (r != 0) {
-			panic("pgfault sys_page_alloc for page not present failed: %e", r);
+			panic("pgfault mapping page not present failed: %e", r);
 		}
 		return;
 	}
@@ -61,79 +66,23 @@ pgfault(struct UTrapframe *utf)
 }
 
 //
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address. If the page is writeable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	int r;
-	if (uvpt[pn] & PTE_SHARE) {
-		r = sys_page_map(0, (void*)(pn*PGSIZE), envid, (void*)(pn*PGSIZE), uvpt[pn] & PTE_SYSCALL);
-		if (r != 0) {
-			panic("duppage sys_page_map 0 failed");
-			return r;
-		}
-	} else if ((uvpt[pn] & PTE_W) || (uvpt[pn] & PTE_COW)) {
-		// Must map envid's page first, otherwise something tricky will happen
-		r = sys_page_map(0, (void*)(pn*PGSIZE), envid, (void*)(pn*PGSIZE), PTE_P | PTE_U | PTE_COW);
-		if (r != 0) {
-			panic("duppage sys_page_map 1 failed");
-			return r;
-		}
-		r = sys_page_map(0, (void*)(pn*PGSIZE), 0, (void*)(pn*PGSIZE), PTE_P | PTE_U | PTE_COW);
-		if (r != 0) {
-			panic("duppage sys_page_map 2 failed");
-			return r;
-		}
-	} else {
-		r = sys_page_map(0, (void*)(pn*PGSIZE), envid, (void*)(pn*PGSIZE), PTE_P | PTE_U);
-		if (r != 0) {
-			panic("duppage sys_page_map 3 failed: %e", r);
-			return r;
-		}
-	}
-
-	return 0;
-}
-
-//
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Fork with copy-on-write.
+// The kernel does the work (sys_fork): it gives the child a copy-on-write
+// copy of our address space and a user exception stack of its own, and
+// resolves writes to copy-on-write pages itself. We still install
+// pgfault, which the child inherits, for faults on unmapped pages.
 //
 // Return: child's envid to the parent, 0 to the child, < 0 on error.
-// It is also OK to panic on error.
-//
-// Hint:
-//	Use uvpd, uvpt, and duppage.
-//	Remember to fix "thisenv" in the child process.
-//	Neither user exception stack should ever be marked copy-on-write,
-//	so we must allocate a new page for the child's user exception stack.
 //
 envid_t
 fork(void)
 {
 	envid_t envid;
-	uint8_t *addr;
-	int r;
-	extern unsigned char end[];
 
 	set_pgfault_handler(pgfault);
-	// Allocate a new child environment.
-	// The kernel will initialize it with a copy of our register state,
-	// so that the child will appear to have called sys_exofork() too -
-	// except that in the child, this "fake" call to sys_exofork()
-	// will return 0 instead of the envid of the child.
-	envid = sys_exofork();
+	envid = sys_fork();
 	if (envid < 0) {
-		cprintf("fork sys_exofork failed: %e\n", envid);
+		cprintf("fork sys_fork failed: %e\n", envid);
 	}
 	if (envid == 0) {
 		// We're the child.
@@ -144,27 +93,5 @@ fork(void)
 		return 0;
 	}
 
-	// We're the parent.
-	// Eagerly copy-on-write our entire address space into the child.
-	for (addr = 0; addr < (uint8_t *) UTOP; addr += PGSIZE) {
-		if (addr == (uint8_t *)(UXSTACKTOP - PGSIZE)) {
-			continue;
-		}
-		if (!(uvpd[PDX(addr)] & PTE_P) || !(uvpt[PGNUM(addr)] & PTE_P)) {
-			continue;
-		}
-		duppage(envid, (unsigned)addr/PGSIZE);
-	}
-
-	// Allocate a new page for the child's user exception stack
-	if ((r = sys_page_alloc(envid, (void*)(UXSTACKTOP - PGSIZE), PTE_P | PTE_W | PTE_U)) < 0) {
-		cprintf("fork sys_page_alloc failed: %e ");
-	}
-
-	// Start the child environment running
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0) {
-		cprintf("fork sys_env_set_status failed: %e\n", r);
-	}
-
 	return envid;
 }
@@ -21,15 +21,21 @@
 //	a perfectly valid place to map a page.)
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	return ipc_recv_timeout(from_env_store, pg, perm_store, 0);
+}
+
+// Like ipc_recv, but give up after 'timeout' milliseconds and return
+// -E_TIMEOUT. A timeout of 0 waits forever.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+		 unsigned int timeout)
 {
 	int r;
 
 	pg = pg == NULL ? (void *)UTOP : pg;
 
-	r = sys_ipc_recv(pg);
-	if (r != 0) {
-		return r;
-	}
+	r = sys_ipc_recv(pg, timeout);
 
 	if (from_env_store != NULL) {
 		*from_env_store = r == 0 ? thisenv->env_ipc_from : 0;
@@ -37,41 +43,101 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	if (perm_store != NULL) {
 		*perm_store = r == 0 ? thisenv->env_ipc_perm : 0;
 	}
+	if (r != 0) {
+		return r;
+	}
 
 	return thisenv->env_ipc_value;
 }
 
-// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'
-// This function keeps trying until  it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
-//
-// Hints:
-//		Use sys_yield() to be CPU-friendly.
-//		If 'pg' is null, pass sys_ipc_try_send a value that it will understand
-//		as meaning "no page". (Zero is not the right value).
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
+// If 'to_env' is not receiving, the kernel queues the message for it,
+// blocking us only while its queue is full; see sys_ipc_send.
+// Panics on any error.
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
-	int r, i;
+	int r;
+
+	pg = pg == NULL ? (void *)UTOP : pg;
+
+	if ((r = sys_ipc_send(to_env, val, pg, perm)) != 0) {
+		panic("ipc_send failed: %e", r);
+	}
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its reply, which is returned like ipc_recv returns a value.
+// Any page in the reply is mapped at 'rcv_pg' if that is nonnull, and
+// its permission stored in *perm_store if that is nonnull.
+// Like ipc_send, panics on any error.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
 
 	pg = pg == NULL ? (void *)UTOP : pg;
+	rcv_pg = rcv_pg == NULL ? (void *)UTOP : rcv_pg;
+
+	if ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) != 0) {
+		panic("ipc_call failed: %e", r);
+	}
+
+	if (perm_store != NULL) {
+		*perm_store = thisenv->env_ipc_perm;
+	}
+	return thisenv->env_ipc_value;
+}
 
-	for (;;) {
-		for (i = 0; i < 10; i++) {
-			r = sys_ipc_try_send(to_env, val, pg, perm);
-			switch(r) {
-			case 0:
-				return;
-			case -E_IPC_NOT_RECV:
-				break;
-			default:
-				panic("ipc_send failed: %e", r);
-			}
+// Like ipc_send, but send the 'len' bytes of pages at 'pg' in one message;
+// see sys_ipc_send_region. 'perm' may include IPC_MOVE to hand the pages
+// over instead of sharing them. Regions are not queued in the kernel, so
+// this keeps trying until 'to_env' is receiving.
+void
+ipc_send_region(envid_t to_env, uint32_t val, void *pg, size_t len, int perm)
+{
+	int r;
+
+	pg = pg == NULL ? (void *)UTOP : pg;
+
+	while ((r = sys_ipc_send_region(to_env, val, pg, len, perm)) != 0) {
+		if (r != -E_IPC_NOT_RECV) {
+			panic("ipc_send_region failed: %e", r);
 		}
 		sys_yield();
 	}
 }
 
+// Like ipc_recv, but accept a region of up to 'len' bytes of pages,
+// mapped from 'pg' on. If 'len_store' is nonnull, store the number of
+// bytes actually mapped in *len_store (0 if none, or on error).
+int32_t
+ipc_recv_region(envid_t *from_env_store, void *pg, size_t len,
+		size_t *len_store, int *perm_store)
+{
+	int r;
+
+	pg = pg == NULL ? (void *)UTOP : pg;
+
+	r = sys_ipc_recv_region(pg, len, 0);
+
+	if (from_env_store != NULL) {
+		*from_env_store = r == 0 ? thisenv->env_ipc_from : 0;
+	}
+	if (len_store != NULL) {
+		*len_store = r == 0 ? thisenv->env_ipc_len : 0;
+	}
+	if (perm_store != NULL) {
+		*perm_store = r == 0 ? thisenv->env_ipc_perm : 0;
+	}
+	if (r != 0) {
+		return r;
+	}
+
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type. We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -8,7 +8,8 @@ pageref(void *v)
 	if (!uvpd[PDX(v)] & PTE_P) {
 		return 0;
 	}
-	pte = uvpt[PGNUM(v)];
+	// A 4MB page's references are counted on its first page.
+	pte = (uvpd[PDX(v)] & PTE_PS) ? uvpd[PDX(v)] : uvpt[PGNUM(v)];
 	if (!(pte & PTE_P)) {
 		return 0;
 	}
@@ -27,6 +27,7 @@
 	[E_FAULT] = "segmentation fault",
 	[E_NO_SYS] = "unimplemented system call",
 	[E_IPC_NOT_RECV] = "env is not recving",
+	[E_TIMEOUT] = "timed out",
 	[E_EOF] = "unexpected end of file",
 	[E_NO_DISK] = "no free space on disk",
 	[E_MAX_OPEN] = "too many files are open",
@@ -285,10 +285,8 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
-			// allocate a black page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0) {
-				return r;
-			}
+			// the rest is blank: demand-zero pages
+			return sys_page_zero(child, (void*) (va + i), memsz - i, perm);
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0) {
@@ -309,21 +307,71 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	return 0;
 }
 
+// Mappings queued by copy_shared_pages, and their results
+static struct PageMapOp share_ops[PAGE_MAP_BATCH_MAX];
+static int share_results[PAGE_MAP_BATCH_MAX];
+
+// Apply the first n mappings in share_ops.
+// Returns 0, or the first error among them.
+static int
+share_flush(unsigned n)
+{
+	int r;
+	unsigned i;
+
+	if (n == 0) {
+		return 0;
+	}
+	if ((r = sys_page_map_batch(share_ops, n, share_results)) <= 0) {
+		return r;
+	}
+	for (i = 0; i < n; i++) {
+		if (share_results[i] < 0) {
+			return share_results[i];
+		}
+	}
+	return 0;
+}
+
 // Copy the mappings for shared pages into the child address space.
+// The mappings are made in batches with sys_page_map_batch.
 static int
 copy_shared_pages(envid_t child)
 {
-	int r;
+	int r, perm;
 	void *addr;
+	unsigned n = 0;
 
 	for (addr = 0; addr < (void *) UTOP; addr += PGSIZE)	{
-		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_SHARE)) {
-			if ((r = sys_page_map(0, (void *)addr, child, (void *)addr, 
-					uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) {
+		if (!(uvpd[PDX(addr)] & PTE_P)) {
+			// No page table: skip the whole 4MB.
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
+		if (uvpd[PDX(addr)] & PTE_PS) {
+			perm = uvpd[PDX(addr)];
+		} else {
+			perm = uvpt[PGNUM(addr)];
+		}
+		if (!(perm & PTE_P) || !(perm & PTE_SHARE)) {
+			continue;
+		}
+
+		share_ops[n].pm_srcenv = 0;
+		share_ops[n].pm_srcva = addr;
+		share_ops[n].pm_dstenv = child;
+		share_ops[n].pm_dstva = addr;
+		share_ops[n].pm_perm = perm & PTE_SYSCALL;
+		if (++n == PAGE_MAP_BATCH_MAX) {
+			if ((r = share_flush(n)) < 0) {
 				return r;
 			}
+			n = 0;
+		}
+		if (uvpd[PDX(addr)] & PTE_PS) {
+			addr += PTSIZE - PGSIZE;
 		}
 	}
 
-	return 0;
+	return share_flush(n);
 }
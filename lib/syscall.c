@@ -112,9 +112,9 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 }
 
 int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, unsigned int timeout)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return syscall(SYS_ipc_recv, 0, (uint32_t)dstva, timeout, 0, 0, 0);
 }
 
 unsigned int
@@ -132,3 +132,95 @@ int sys_rx_pkt(struct rx_desc *rd)
 {
 	return syscall(SYS_rx_pkt, 0, (uint32_t) rd, 0, 0, 0, 0);
 }
+
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+uint64_t
+sys_time_nsec(void)
+{
+	uint64_t nsec;
+
+	syscall(SYS_time_nsec, 0, (uint32_t) &nsec, 0, 0, 0, 0);
+	return nsec;
+}
+
+int
+sys_sleep_until(unsigned int msec)
+{
+	return syscall(SYS_sleep_until, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		(uint32_t) dstva);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, mask, 0, 0, 0);
+}
+
+int
+sys_env_stats(envid_t envid, struct EnvStats *st)
+{
+	return syscall(SYS_env_stats, 0, envid, (uint32_t) st, 0, 0, 0);
+}
+
+int
+sys_cpu_stats(int cpu, struct EnvStats *st)
+{
+	return syscall(SYS_cpu_stats, 0, cpu, (uint32_t) st, 0, 0, 0);
+}
+
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+sys_page_map_batch(const struct PageMapOp *ops, unsigned n, int *results)
+{
+	return syscall(SYS_page_map_batch, 0, (uint32_t) ops, n,
+		(uint32_t) results, 0, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_zero(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_zero, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_ipc_send_region(envid_t envid, uint32_t value, void *srcva, size_t len,
+		    int perm)
+{
+	return syscall(SYS_ipc_send_region, 0, envid, value, (uint32_t) srcva,
+		len, perm);
+}
+
+int
+sys_ipc_recv_region(void *dstva, size_t len, unsigned int timeout)
+{
+	return syscall(SYS_ipc_recv_region, 0, (uint32_t) dstva, len, timeout,
+		0, 0);
+}
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
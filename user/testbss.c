@@ -0,0 +1,56 @@
+// Test demand-zero memory: a large bss, and memory from sys_page_zero,
+// must read as zeros, and pages written separately must stay separate
+// even though they all start out as the shared zero page.
+
+#include <inc/lib.h>
+
+#define ARRAYSIZE	(1024*1024)
+#define ZERO_VA		((uint32_t *) 0xA0000000)
+#define ZERO_PAGES	4
+
+uint32_t bigarray[ARRAYSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	uint32_t *p;
+
+	cprintf("Making sure bss works right...\n");
+	for (i = 0; i < ARRAYSIZE; i++) {
+		if (bigarray[i] != 0) {
+			panic("bigarray[%d] isn't cleared!\n", i);
+		}
+	}
+	for (i = 0; i < ARRAYSIZE; i++) {
+		bigarray[i] = i;
+	}
+	for (i = 0; i < ARRAYSIZE; i++) {
+		if (bigarray[i] != i) {
+			panic("bigarray[%d] didn't hold its value!\n", i);
+		}
+	}
+	cprintf("bss is zeroed and private\n");
+
+	if ((r = sys_page_zero(0, ZERO_VA, ZERO_PAGES * PGSIZE,
+			       PTE_P | PTE_W | PTE_U)) < 0) {
+		panic("sys_page_zero: %e", r);
+	}
+	for (i = 0; i < ZERO_PAGES; i++) {
+		p = ZERO_VA + i * PGSIZE / sizeof(*p);
+		if (p[0] != 0 || p[PGSIZE / sizeof(*p) - 1] != 0) {
+			panic("page %d from sys_page_zero isn't zero", i);
+		}
+	}
+	// Write every other page; the pages in between must still be zero.
+	for (i = 0; i < ZERO_PAGES; i += 2) {
+		ZERO_VA[i * PGSIZE / sizeof(*p)] = i + 1;
+	}
+	for (i = 0; i < ZERO_PAGES; i++) {
+		p = ZERO_VA + i * PGSIZE / sizeof(*p);
+		if (p[0] != (i % 2 ? 0 : i + 1)) {
+			panic("page %d from sys_page_zero holds %d", i, p[0]);
+		}
+	}
+	cprintf("sys_page_zero pages are zeroed and private\n");
+}
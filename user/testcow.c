@@ -0,0 +1,58 @@
+// Test copy-on-write after fork: parent and child must not see each
+// other's writes, whether to data, the stack or a 4MB page.
+
+#include <inc/lib.h>
+
+#define LARGE_VA	((char *) 0x40000000)
+
+int counter = 1;
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int large;
+	volatile int local = 1;		// on the stack, not in a register
+
+	large = sys_page_alloc_large(0, LARGE_VA, PTE_P | PTE_W | PTE_U);
+	if (large == 0) {
+		LARGE_VA[0] = 1;
+	} else if (large != -E_NOT_SUPP && large != -E_NO_MEM) {
+		panic("sys_page_alloc_large: %e", large);
+	} else {
+		cprintf("no 4MB page: %e\n", large);
+	}
+
+	if ((who = fork()) < 0) {
+		panic("fork: %e", who);
+	}
+	if (who == 0) {
+		// Wait until the parent has written, then write ourselves.
+		ipc_recv(NULL, 0, NULL);
+		cprintf("child keeps its data %s\n",
+			counter == 1 && local == 1 ? "right" : "wrong");
+		if (large == 0) {
+			cprintf("child keeps its 4MB page %s\n",
+				LARGE_VA[0] == 1 ? "right" : "wrong");
+			LARGE_VA[0] = 2;
+		}
+		counter = 2;
+		local = 2;
+		exit();
+	}
+
+	counter = 3;
+	local = 3;
+	if (large == 0) {
+		LARGE_VA[0] = 3;
+	}
+	ipc_send(who, 0, 0, 0);
+	wait(who);
+
+	cprintf("parent keeps its data %s\n",
+		counter == 3 && local == 3 ? "right" : "wrong");
+	if (large == 0) {
+		cprintf("parent keeps its 4MB page %s\n",
+			LARGE_VA[0] == 3 ? "right" : "wrong");
+	}
+}
@@ -0,0 +1,52 @@
+// Test kernel-queued IPC: a sender to an env that isn't receiving gets
+// its messages queued, blocks once the queue is full instead of
+// spinning, and every message arrives, in order, with its page.
+
+#include <inc/lib.h>
+
+#define NMSG		20
+#define VA			((char *) 0xA0000000)
+
+const char *msg = "queued page";
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who, from;
+	int i, r, perm;
+	bool ok;
+
+	if ((who = fork()) < 0) {
+		panic("fork: %e", who);
+	}
+	if (who == 0) {
+		who = thisenv->env_parent_id;
+		for (i = 0; i < NMSG; i++) {
+			ipc_send(who, i, 0, 0);
+		}
+		if ((r = sys_page_alloc(0, VA, PTE_P | PTE_W | PTE_U)) < 0) {
+			panic("sys_page_alloc: %e", r);
+		}
+		strcpy(VA, msg);
+		ipc_send(who, NMSG, VA, PTE_P | PTE_W | PTE_U);
+		return;
+	}
+
+	// Don't receive for a while, so that the child fills our queue.
+	sys_sleep_until(sys_time_msec() + 200);
+	cprintf("sender blocks on a full queue %s\n",
+		envs[ENVX(who)].env_status == ENV_NOT_RUNNABLE ? "right" : "wrong");
+
+	ok = 1;
+	for (i = 0; i < NMSG; i++) {
+		if (ipc_recv(&from, 0, NULL) != i || from != who) {
+			ok = 0;
+		}
+	}
+	cprintf("queued messages arrive in order %s\n", ok ? "right" : "wrong");
+
+	r = ipc_recv(&from, VA, &perm);
+	cprintf("queued page arrives %s\n",
+		r == NMSG && from == who && perm && strcmp(VA, msg) == 0 ?
+		"right" : "wrong");
+}
@@ -0,0 +1,51 @@
+// Test IPC receive timeouts: a receive that nobody answers must block,
+// fail with -E_TIMEOUT once its time is up and leave the env runnable,
+// while a message that arrives in time must cancel the timeout.
+
+#include <inc/lib.h>
+
+#define TIMEOUT		100
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who, from;
+	unsigned int start, now;
+	int r;
+
+	if ((who = fork()) < 0) {
+		panic("fork: %e", who);
+	}
+	if (who == 0) {
+		start = sys_time_msec();
+		r = ipc_recv_timeout(&from, 0, NULL, TIMEOUT);
+		now = sys_time_msec();
+		cprintf("unanswered receive times out %s\n",
+			r == -E_TIMEOUT && from == 0 && now >= start + TIMEOUT ?
+			"right" : "wrong");
+
+		// Tell the parent we're back, then wait for a message that
+		// arrives well before the timeout.
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		r = ipc_recv_timeout(&from, 0, NULL, 10 * TIMEOUT);
+		cprintf("answered receive gets the message %s\n",
+			r == 1 && from == thisenv->env_parent_id ? "right" : "wrong");
+
+		// The cancelled timeout must not cut a later sleep short.
+		start = sys_time_msec();
+		sys_sleep_until(start + 10 * TIMEOUT);
+		cprintf("cancelled timeout stays cancelled %s\n",
+			sys_time_msec() >= start + 10 * TIMEOUT ? "right" : "wrong");
+		return;
+	}
+
+	sys_sleep_until(sys_time_msec() + TIMEOUT / 2);
+	cprintf("receiver blocks while it waits %s\n",
+		envs[ENVX(who)].env_status == ENV_NOT_RUNNABLE ? "right" : "wrong");
+
+	// The child only gets here if the timeout made it runnable again.
+	ipc_recv(NULL, 0, NULL);
+	sys_sleep_until(sys_time_msec() + TIMEOUT / 2);
+	ipc_send(who, 1, 0, 0);
+	wait(who);
+}
@@ -0,0 +1,100 @@
+// Test region IPC: send several pages in one message, first shared, then
+// moved into a receive window too small for all of them.
+
+#include <inc/lib.h>
+
+#define NPAGES		8
+#define WINDOW		4
+#define SRC_VA		((char *) 0xA0000000)
+#define MOVE_VA		((char *) 0xA0400000)
+#define DST_VA		((char *) 0xB0000000)
+#define MOVE_DST_VA	((char *) 0xB0400000)
+
+static bool
+mapped(void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+static void
+fill(char *va)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, va + i * PGSIZE, PTE_P | PTE_W | PTE_U)) < 0) {
+			panic("sys_page_alloc: %e", r);
+		}
+		*(int *) (va + i * PGSIZE) = i;
+	}
+}
+
+static bool
+check(char *va, int npages)
+{
+	int i;
+
+	for (i = 0; i < npages; i++) {
+		if (*(int *) (va + i * PGSIZE) != i) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+child(void)
+{
+	envid_t who;
+	size_t len;
+	int perm;
+
+	ipc_recv_region(&who, DST_VA, NPAGES * PGSIZE, &len, &perm);
+	cprintf("child got a shared region %s\n",
+		len == NPAGES * PGSIZE && (perm & PTE_W) && check(DST_VA, NPAGES) ?
+		"right" : "wrong");
+	*(int *) DST_VA = 0xBEEF;
+	ipc_send(who, 0, 0, 0);
+
+	ipc_recv_region(&who, MOVE_DST_VA, WINDOW * PGSIZE, &len, NULL);
+	cprintf("child got a moved region %s\n",
+		len == WINDOW * PGSIZE && check(MOVE_DST_VA, WINDOW) &&
+		!mapped(MOVE_DST_VA + WINDOW * PGSIZE) ? "right" : "wrong");
+	ipc_send(who, 0, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i;
+	bool ok;
+
+	if ((who = fork()) < 0) {
+		panic("fork: %e", who);
+	}
+	if (who == 0) {
+		child();
+		return;
+	}
+
+	fill(SRC_VA);
+	ipc_send_region(who, 0, SRC_VA, NPAGES * PGSIZE, PTE_P | PTE_W | PTE_U);
+	ipc_recv(NULL, 0, NULL);
+	cprintf("parent sees the child's write %s\n",
+		*(int *) SRC_VA == 0xBEEF ? "right" : "wrong");
+
+	// Only the pages that fit in the child's window change hands.
+	fill(MOVE_VA);
+	ipc_send_region(who, 0, MOVE_VA, NPAGES * PGSIZE,
+			PTE_P | PTE_W | PTE_U | IPC_MOVE);
+	ok = 1;
+	for (i = 0; i < NPAGES; i++) {
+		if (mapped(MOVE_VA + i * PGSIZE) != (i >= WINDOW)) {
+			ok = 0;
+		}
+	}
+	cprintf("parent gave up the moved pages %s\n", ok ? "right" : "wrong");
+	ipc_recv(NULL, 0, NULL);
+	wait(who);
+}
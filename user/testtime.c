@@ -14,9 +14,7 @@ sleep(int sec)
 		panic("sleep: warp");
 	}
 
-	while(sys_time_msec() < end) {
-		sys_yield();
-	}
+	sys_sleep_until(end);
 }
 
 void